@@ -0,0 +1,4 @@
+main.o: main.cpp vfs/ivfs.hpp vfs/inodemanager.hpp vfs/blockmanager.hpp \
+ vfs/freebitmap.hpp vfs/superblock.hpp vfs/journal.hpp vfs/blockcache.hpp \
+ vfs/dirmanager.hpp vfs/dentrycache.hpp vfs/openfiletable.hpp \
+ vfs/iopool.hpp vfs/asyncqueue.hpp
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+#include "../vfs/freebitmap.hpp"
+
+static const size_t bitmap_bits = 1 << 20;
+static const int allocations = 2000;
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the allocator BlockManager used before FreeBitmap */
+static size_t old_search_free(char *bitmap, size_t bytes)
+{
+        for (size_t i = 0; i < bytes; i++) {
+                for (char mask = 0x1, j = 0; mask; mask <<= 1, j++) {
+                        if (bitmap[i] & mask) {
+                                bitmap[i] &= ~mask;
+                                return i * 8 + j;
+                        }
+                }
+        }
+        return (size_t)-1;
+}
+
+static void fill(uint64_t *words, double level)
+{
+        size_t used = bitmap_bits * level;
+        memset(words, 0xFF, bitmap_bits / 8);
+        memset(words, 0, used / 8);
+        srand(1);
+        for (size_t i = used; i < bitmap_bits; i++) {
+                if (rand() % 100 < level * 100)
+                        words[i / 64] &= ~((uint64_t)1 << i % 64);
+        }
+}
+
+int main(void)
+{
+        const double levels[] = { 0.0, 0.5, 0.9, 0.99, 0.999 };
+        uint64_t *words = new uint64_t[bitmap_bits / 64];
+        printf("%-8s %14s %14s %10s\n", "fill", "old ns/alloc",
+               "new ns/alloc", "speedup");
+        for (size_t l = 0; l < sizeof(levels) / sizeof(*levels); l++) {
+                fill(words, levels[l]);
+                double t = now();
+                for (int i = 0; i < allocations; i++)
+                        old_search_free((char*)words, bitmap_bits / 8);
+                double old_time = now() - t;
+
+                fill(words, levels[l]);
+                FreeBitmap fb;
+                fb.Attach(words, bitmap_bits);
+                t = now();
+                for (int i = 0; i < allocations; i++)
+                        fb.Allocate();
+                double new_time = now() - t;
+
+                printf("%-8.1f %14.1f %14.1f %9.1fx\n", levels[l] * 100,
+                       old_time * 1e9 / allocations,
+                       new_time * 1e9 / allocations, old_time / new_time);
+        }
+        delete[] words;
+        return 0;
+}
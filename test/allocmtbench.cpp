@@ -0,0 +1,90 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <time.h>
+#include "../vfs/ivfs.hpp"
+
+static const size_t file_size = 8 << 20;
+static const size_t chunk = 4096;
+static const int max_views = 4096;
+
+struct Writer {
+        IVFS *vfs;
+        int id;
+        double time;
+        int areas;
+};
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* appends the file a block at a time, so every write allocates */
+static void *writer(void *arg)
+{
+        Writer *w = (Writer*)arg;
+        char path[32], buf[chunk];
+        memset(buf, 'a' + w->id % 26, sizeof(buf));
+        sprintf(path, "/w%d", w->id);
+        double t = now();
+        File *f = w->vfs->Open(path, "wc");
+        for (size_t pos = 0; pos < file_size; pos += chunk)
+                w->vfs->Write(f, buf, chunk);
+        w->vfs->Close(f);
+        w->time = now() - t;
+        return 0;
+}
+
+/* contiguous areas the file is made of, fewer means better locality */
+static int count_areas(IVFS &vfs, int id)
+{
+        char path[32];
+        FileView *views = new FileView[max_views];
+        sprintf(path, "/w%d", id);
+        File *f = vfs.Open(path, "r");
+        int n = vfs.MapRange(f, 0, file_size, views, max_views);
+        vfs.ReleaseViews(views, n);
+        vfs.Close(f);
+        delete[] views;
+        return n;
+}
+
+static void run(int threads)
+{
+        IVFS vfs;
+        if (!vfs.Boot("./work_dir/", true))
+                exit(1);
+        Writer *w = new Writer[threads];
+        pthread_t *tid = new pthread_t[threads];
+        double t = now();
+        for (int i = 0; i < threads; i++) {
+                w[i].vfs = &vfs;
+                w[i].id = i;
+                pthread_create(&tid[i], 0, writer, &w[i]);
+        }
+        for (int i = 0; i < threads; i++)
+                pthread_join(tid[i], 0);
+        double total = now() - t;
+        int areas = 0;
+        for (int i = 0; i < threads; i++)
+                areas += count_areas(vfs, i);
+        printf("%7d %12.0f %16.1f %9.2fs\n", threads,
+               threads * (file_size >> 20) / total,
+               (double)areas / threads, total);
+        delete[] w;
+        delete[] tid;
+}
+
+int main(int argc, char **argv)
+{
+        int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+        printf("%7s %12s %16s %10s\n", "threads", "write MB/s",
+               "areas per file", "total");
+        for (int n = 1; n <= max_threads; n *= 2)
+                run(n);
+        return 0;
+}
@@ -0,0 +1,61 @@
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include "../vfs/ivfs.hpp"
+
+static const int dirs_amount = 20;
+static const int batch_size = 5000;
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int files, bool batched)
+{
+        IVFS vfs;
+        if (!vfs.Boot("./work_dir/", true))
+                exit(1);
+        char **paths = new char*[files];
+        for (int i = 0; i < files; i++) {
+                paths[i] = new char[32];
+                sprintf(paths[i], "/d%d/f%d", i % dirs_amount, i);
+        }
+        double t = now();
+        for (int i = 0; i < files; i += batched ? batch_size : 1) {
+                if (!batched) {
+                        vfs.Create(paths[i]);
+                        continue;
+                }
+                int n = files - i < batch_size ? files - i : batch_size;
+                vfs.CreateBatch(paths + i, n);
+        }
+        double create_time = now() - t;
+        t = now();
+        for (int i = 0; i < files; i += batched ? batch_size : 1) {
+                if (!batched) {
+                        vfs.Remove(paths[i]);
+                        continue;
+                }
+                int n = files - i < batch_size ? files - i : batch_size;
+                vfs.RemoveBatch(paths + i, n);
+        }
+        double remove_time = now() - t;
+        printf("%-8s %7d %14.0f %14.0f\n", batched ? "batch" : "single",
+               files, files / create_time, files / remove_time);
+        for (int i = 0; i < files; i++)
+                delete[] paths[i];
+        delete[] paths;
+}
+
+int main(int argc, char **argv)
+{
+        int files = argc > 1 ? atoi(argv[1]) : 20000;
+        printf("%-8s %7s %14s %14s\n", "calls", "files",
+               "creates/s", "removes/s");
+        run(files, false);
+        run(files, true);
+        return 0;
+}
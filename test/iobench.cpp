@@ -0,0 +1,59 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+#include "../vfs/ivfs.hpp"
+
+static const size_t file_size = 64 << 20;
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double mb_per_sec(double seconds)
+{
+        return file_size / seconds / (1 << 20);
+}
+
+int main(void)
+{
+        const size_t chunks[] = { 4096, 65536, 1 << 20, 8 << 20 };
+        char *buf = new char[file_size];
+        char *copy = new char[file_size];
+        memset(buf, 'x', file_size);
+        double t = now();
+        memcpy(copy, buf, file_size);
+        printf("memcpy %.0f MB/s\n", mb_per_sec(now() - t));
+        IVFS vfs;
+        if (!vfs.Boot("./work_dir/", true))
+                return 1;
+        printf("%-10s %12s %12s\n", "chunk", "write MB/s", "read MB/s");
+        for (size_t c = 0; c < sizeof(chunks) / sizeof(*chunks); c++) {
+                File *f = vfs.Open("/bench", "wc");
+                t = now();
+                for (size_t pos = 0; pos < file_size; pos += chunks[c])
+                        vfs.Write(f, buf + pos, chunks[c]);
+                double write_time = now() - t;
+                vfs.Close(f);
+                f = vfs.Open("/bench", "r");
+                t = now();
+                for (size_t pos = 0; pos < file_size; pos += chunks[c])
+                        vfs.Read(f, copy + pos, chunks[c]);
+                double read_time = now() - t;
+                vfs.Close(f);
+                vfs.Remove("/bench");
+                printf("%-10lu %12.0f %12.0f\n", (unsigned long)chunks[c],
+                       mb_per_sec(write_time), mb_per_sec(read_time));
+        }
+        ReadaheadStats ra = vfs.ReadaheadCounters();
+        printf("readahead: %llu blocks prefetched, %llu hits, %llu misses, "
+               "%llu random switches\n", (unsigned long long)ra.prefetched,
+               (unsigned long long)ra.hits, (unsigned long long)ra.misses,
+               (unsigned long long)ra.random);
+        delete[] buf;
+        delete[] copy;
+        return 0;
+}
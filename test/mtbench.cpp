@@ -0,0 +1,97 @@
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+#include "../vfs/ivfs.hpp"
+
+static const int files_per_thread = 500;
+static const int open_rounds = 20;
+
+struct Worker {
+        IVFS *vfs;
+        int id;
+        bool shared_dir;
+        double create_time;
+        double open_time;
+};
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void file_path(char *buf, const Worker *w, int i)
+{
+        if (w->shared_dir)
+                sprintf(buf, "/shared/t%d_f%d", w->id, i);
+        else
+                sprintf(buf, "/t%d/f%d", w->id, i);
+}
+
+static void *worker(void *arg)
+{
+        Worker *w = (Worker*)arg;
+        char path[64];
+        double t = now();
+        for (int i = 0; i < files_per_thread; i++) {
+                file_path(path, w, i);
+                w->vfs->Close(w->vfs->Open(path, "wc"));
+        }
+        w->create_time = now() - t;
+        t = now();
+        for (int r = 0; r < open_rounds; r++) {
+                for (int i = 0; i < files_per_thread; i++) {
+                        file_path(path, w, i);
+                        w->vfs->Close(w->vfs->Open(path, "r"));
+                }
+        }
+        w->open_time = now() - t;
+        return 0;
+}
+
+static void run(int threads, bool shared_dir)
+{
+        IVFS vfs;
+        if (!vfs.Boot("./work_dir/", true))
+                exit(1);
+        if (shared_dir)
+                vfs.Create("/shared", true);
+        Worker *w = new Worker[threads];
+        pthread_t *tid = new pthread_t[threads];
+        double t = now();
+        for (int i = 0; i < threads; i++) {
+                w[i].vfs = &vfs;
+                w[i].id = i;
+                w[i].shared_dir = shared_dir;
+                pthread_create(&tid[i], 0, worker, &w[i]);
+        }
+        double create_time = 0, open_time = 0;
+        for (int i = 0; i < threads; i++) {
+                pthread_join(tid[i], 0);
+                if (w[i].create_time > create_time)
+                        create_time = w[i].create_time;
+                if (w[i].open_time > open_time)
+                        open_time = w[i].open_time;
+        }
+        double total = now() - t;
+        int files = threads * files_per_thread;
+        printf("%-8s %7d %14.0f %14.0f %9.2fs\n",
+               shared_dir ? "shared" : "private", threads,
+               files / create_time, files * open_rounds / open_time, total);
+        delete[] w;
+        delete[] tid;
+}
+
+int main(int argc, char **argv)
+{
+        int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+        printf("%-8s %7s %14s %14s %10s\n", "dirs", "threads",
+               "creates/s", "opens/s", "total");
+        for (int s = 0; s < 2; s++) {
+                for (int n = 1; n <= max_threads; n *= 2)
+                        run(n, s == 1);
+        }
+        return 0;
+}
@@ -1,7 +1,9 @@
 #include <iostream>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "../vfs/ivfs.hpp"
 
 static void write_file_to_vfs(IVFS &vfs, const char *path, const char *file)
@@ -105,6 +107,104 @@ int main(void)
         else
                 std::cerr << "BUG #6 !!!" << std::endl;
 
+        f1 = vfs.Open("/home/positional", "rwc");
+        vfs.PWrite(f1, hello, sizeof(hello), 5000);
+        res = vfs.PRead(f1, buf, sizeof(hello), 5000);
+        if (res == sizeof(hello) && !memcmp(buf, hello, sizeof(hello)) &&
+            vfs.Size(f1) == 5000 + (off_t)sizeof(hello))
+                std::cerr << "POSITIONAL WRITE/READ: OK!" << std::endl;
+        else
+                std::cerr << "BUG #7 !!!" << std::endl;
+        res = vfs.PRead(f1, buf, 4, 4096);
+        if (res == 4 && !buf[0] && !buf[1] && !buf[2] && !buf[3])
+                std::cerr << "HOLE READS AS ZEROS: OK!" << std::endl;
+        else
+                std::cerr << "BUG #8 !!!" << std::endl;
+        vfs.Close(f1);
+
+        char head[] = "HEAD", tail[] = "TAIL", both[8];
+        struct iovec iov[2] = { { head, 4 }, { tail, 4 } };
+        f1 = vfs.Open("/home/vectored", "rwc");
+        vfs.PWriteV(f1, iov, 2, 4090);
+        vfs.Lseek(f1, 4090, 0);
+        res = vfs.Read(f1, both, sizeof(both));
+        if (res == 8 && !memcmp(both, "HEADTAIL", 8))
+                std::cerr << "VECTORED WRITE: OK!" << std::endl;
+        else
+                std::cerr << "BUG #9 !!!" << std::endl;
+        FileView views[2];
+        rc = vfs.MapRange(f1, 4090, 8, views, 2);
+        res = 0;
+        for (int i = 0; i < rc; i++) {
+                memcpy(both + res, views[i].data, views[i].len);
+                res += views[i].len;
+        }
+        vfs.ReleaseViews(views, rc);
+        if (res == 8 && !memcmp(both, "HEADTAIL", 8))
+                std::cerr << "ZERO-COPY VIEWS: OK!" << std::endl;
+        else
+                std::cerr << "BUG #10 !!!" << std::endl;
+        vfs.Close(f1);
+
+        AsyncQueue aq(vfs);
+        AsyncRequest reqs[8], *batch[8], *done[8];
+        char parts[8][16], back[8][16];
+        memset(reqs, 0, sizeof(reqs));
+        reqs[0].op = async_open;
+        reqs[0].path = "/home/async";
+        reqs[0].flags = "rwc";
+        batch[0] = &reqs[0];
+        aq.Submit(batch, 1);
+        aq.Wait(done, 1, 1);
+        f1 = reqs[0].fp;
+        for (int i = 0; i < 8; i++) {
+                sprintf(parts[i], "part %d of 8 ..", i);
+                reqs[i].op = async_write;
+                reqs[i].fp = f1;
+                reqs[i].buf = parts[i];
+                reqs[i].len = 16;
+                reqs[i].offset = i * 16;
+                batch[i] = &reqs[i];
+        }
+        aq.Submit(batch, 8);
+        for (rc = 0; rc < 8; )
+                rc += aq.Wait(done + rc, 8 - rc, 8 - rc);
+        for (int i = 0; i < 8; i++) {
+                reqs[i].op = async_read;
+                reqs[i].buf = back[i];
+        }
+        aq.Submit(batch, 8);
+        for (rc = 0; rc < 8; )
+                rc += aq.Wait(done + rc, 8 - rc, 8 - rc);
+        res = 0;
+        for (int i = 0; i < 8; i++) {
+                if (reqs[i].result == 16 && !memcmp(back[i], parts[i], 16))
+                        res++;
+        }
+        reqs[0].op = async_close;
+        aq.Submit(batch, 1);
+        aq.Wait(done, 1, 1);
+        if (f1 && res == 8)
+                std::cerr << "ASYNC WRITE/READ: OK!" << std::endl;
+        else
+                std::cerr << "BUG #11 !!!" << std::endl;
+
+        mkdir("./work_dir/small", 0755);
+        {
+                /* fewer inodes than one bitmap word holds */
+                Geometry small = { 4096, 1, 1024, 10, 0 };
+                IVFS tiny;
+                DirListing *ls = 0;
+                tiny.Boot("./work_dir/small/", small);
+                tiny.Create("/a");
+                rc = tiny.List("/", &ls);
+                if (rc == 1 && !strcmp(ls->name, "a") && !ls->is_dir)
+                        std::cerr << "SMALL INODE TABLE: OK!" << std::endl;
+                else
+                        std::cerr << "BUG #12 !!!" << std::endl;
+                IVFS::FreeListing(ls);
+        }
+
         std::cerr << "NOW RUNNING READ/WRITE FILE SYSTEM TESTS" << std::endl;
 
         write_file_to_vfs(vfs, "/usr/local/games/test1", "test/test1");
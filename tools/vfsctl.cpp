@@ -0,0 +1,567 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "../vfs/ivfs.hpp"
+
+static const int default_workers = 4;
+static const int create_chunk = 256;
+static const int file_chunk = 16;
+static const off_t large_file = 1 << 20;
+static const size_t buffer_size = 8 << 20;
+static const size_t buffer_align = 4096;
+static const size_t export_window = 8 << 20;
+static const int max_views = 256;
+
+struct Entry {
+        char *host;
+        char *vfs;
+        off_t size;
+        int depth;
+};
+
+struct EntryList {
+        Entry *items;
+        int count;
+        int cap;
+};
+
+/* what the workers of one phase share; next hands out the entries */
+struct Job {
+        IVFS *vfs;
+        Entry *items;
+        int count;
+        int chunk;
+        int next;
+        int done;
+        int failed;
+        uint64_t bytes;
+};
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *join(const char *dir, const char *name)
+{
+        size_t len = strlen(dir);
+        bool slash = len > 0 && dir[len - 1] == '/';
+        char *path = new char[len + strlen(name) + 2];
+        sprintf(path, slash ? "%s%s" : "%s/%s", dir, name);
+        return path;
+}
+
+static void add(EntryList &l, char *host, char *vfs, off_t size, int depth)
+{
+        if (l.count == l.cap) {
+                l.cap = l.cap ? l.cap * 2 : 64;
+                l.items = (Entry*)realloc(l.items, l.cap * sizeof(Entry));
+        }
+        Entry &e = l.items[l.count++];
+        e.host = host;
+        e.vfs = vfs;
+        e.size = size;
+        e.depth = depth;
+}
+
+static void free_list(EntryList &l)
+{
+        for (int i = 0; i < l.count; i++) {
+                delete[] l.items[i].host;
+                delete[] l.items[i].vfs;
+        }
+        free(l.items);
+}
+
+/* the names the file system accepts in a path */
+static bool valid_name(const char *name)
+{
+        int len = 0;
+        for (; *name; name++, len++) {
+                if (!isalnum(*name) && *name != '_' && *name != '.')
+                        return false;
+        }
+        return len > 0 && len <= DirManager::max_name_len;
+}
+
+static int by_size(const void *a, const void *b)
+{
+        off_t x = ((const Entry*)a)->size, y = ((const Entry*)b)->size;
+        return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int by_depth(const void *a, const void *b)
+{
+        const Entry *x = (const Entry*)a, *y = (const Entry*)b;
+        if (x->depth != y->depth)
+                return x->depth - y->depth;
+        return strcmp(x->vfs, y->vfs);
+}
+
+static void walk_host(const char *host, const char *vfs, int depth,
+                      EntryList &dirs, EntryList &files, int &skipped)
+{
+        DIR *d = opendir(host);
+        if (!d) {
+                perror(host);
+                skipped++;
+                return;
+        }
+        struct dirent *de;
+        while ((de = readdir(d))) {
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+                char *host_path = join(host, de->d_name);
+                struct stat st;
+                bool ok = valid_name(de->d_name);
+                if (!ok) {
+                        fprintf(stderr, "Skipped %s: invalid name\n",
+                                host_path);
+                } else if (lstat(host_path, &st) == -1) {
+                        perror(host_path);
+                        ok = false;
+                }
+                if (!ok || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+                        delete[] host_path;
+                        skipped++;
+                        continue;
+                }
+                char *vfs_path = join(vfs, de->d_name);
+                if (S_ISDIR(st.st_mode)) {
+                        add(dirs, host_path, vfs_path, 0, depth);
+                        walk_host(host_path, vfs_path, depth + 1,
+                                  dirs, files, skipped);
+                } else {
+                        add(files, host_path, vfs_path, st.st_size, depth);
+                }
+        }
+        closedir(d);
+}
+
+static bool walk_vfs(IVFS &vfs, const char *path, const char *host,
+                     int depth, EntryList &dirs, EntryList &files)
+{
+        DirListing *ls;
+        if (vfs.List(path, &ls) == -1) {
+                fprintf(stderr, "Not a directory: %s\n", path);
+                return false;
+        }
+        for (DirListing *tmp = ls; tmp; tmp = tmp->next) {
+                char *vfs_path = join(path, tmp->name);
+                char *host_path = join(host, tmp->name);
+                if (tmp->is_dir) {
+                        add(dirs, host_path, vfs_path, 0, depth);
+                        walk_vfs(vfs, vfs_path, host_path, depth + 1,
+                                 dirs, files);
+                } else {
+                        add(files, host_path, vfs_path, tmp->size, depth);
+                }
+        }
+        IVFS::FreeListing(ls);
+        return true;
+}
+
+static void run_workers(Job &job, void *(*fn)(void*), int workers)
+{
+        pthread_t *tid = new pthread_t[workers];
+        int started = 0;
+        for (; started < workers; started++) {
+                if (pthread_create(&tid[started], 0, fn, &job) != 0)
+                        break;
+        }
+        if (started == 0)
+                fn(&job);
+        for (int i = 0; i < started; i++)
+                pthread_join(tid[i], 0);
+        delete[] tid;
+}
+
+/* hands the next chunk of entries to a worker, a large file alone so
+ * the big ones spread over the workers; false when none is left */
+static bool take(Job &job, int &first, int &last)
+{
+        for (;;) {
+                first = __sync_fetch_and_add(&job.next, 0);
+                if (first >= job.count)
+                        return false;
+                int chunk = job.items[first].size >= large_file ? 1
+                                                                : job.chunk;
+                last = first + chunk < job.count ? first + chunk : job.count;
+                if (__sync_bool_compare_and_swap(&job.next, first, last))
+                        return true;
+        }
+}
+
+/* a directory CreateBatch() did not make may have been there already */
+static bool is_vfs_dir(IVFS &vfs, const char *path)
+{
+        DirListing *ls;
+        bool retval = vfs.List(path, &ls) != -1;
+        IVFS::FreeListing(ls);
+        return retval;
+}
+
+static void *create_dirs(void *arg)
+{
+        Job &job = *(Job*)arg;
+        const char *paths[create_chunk];
+        int first, last;
+        while (take(job, first, last)) {
+                for (int i = first; i < last; i++)
+                        paths[i - first] = job.items[i].vfs;
+                int made = job.vfs->CreateBatch(paths, last - first, true);
+                __sync_fetch_and_add(&job.done, made);
+                for (int i = first; made < last - first && i < last; i++) {
+                        if (is_vfs_dir(*job.vfs, job.items[i].vfs))
+                                continue;
+                        fprintf(stderr, "Failed to create directory %s\n",
+                                job.items[i].vfs);
+                        __sync_fetch_and_add(&job.failed, 1);
+                }
+        }
+        return 0;
+}
+
+static bool read_all(int fd, char *buf, size_t len, off_t pos)
+{
+        while (len > 0) {
+                ssize_t res = pread(fd, buf, len, pos);
+                if (res <= 0)
+                        return false;
+                buf += res;
+                len -= res;
+                pos += res;
+        }
+        return true;
+}
+
+/* the whole file goes in with one Write() where possible, so its blocks
+ * are allocated at once for the known size: small files through the
+ * buffer, large ones straight from a mapping of the host file */
+static bool copy_in(IVFS &vfs, File *f, int fd, size_t size, char *buf)
+{
+        if (size <= buffer_size) {
+                return read_all(fd, buf, size, 0) &&
+                       vfs.Write(f, buf, size) == (ssize_t)size;
+        }
+        void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+                madvise(map, size, MADV_SEQUENTIAL);
+                bool ok = vfs.Write(f, (char*)map, size) == (ssize_t)size;
+                munmap(map, size);
+                return ok;
+        }
+        for (size_t pos = 0; pos < size; pos += buffer_size) {
+                size_t n = size - pos < buffer_size ? size - pos : buffer_size;
+                if (!read_all(fd, buf, n, pos) ||
+                    vfs.Write(f, buf, n) != (ssize_t)n)
+                        return false;
+        }
+        return true;
+}
+
+static bool import_file(IVFS &vfs, const Entry &e, char *buf)
+{
+        int fd = open(e.host, O_RDONLY);
+        if (fd == -1) {
+                perror(e.host);
+                return false;
+        }
+        File *f = vfs.Open(e.vfs, "wt");
+        bool ok = f && copy_in(vfs, f, fd, e.size, buf);
+        if (f)
+                vfs.Close(f);
+        close(fd);
+        if (!ok)
+                fprintf(stderr, "Failed to import %s\n", e.host);
+        return ok;
+}
+
+static void *import_files(void *arg)
+{
+        Job &job = *(Job*)arg;
+        const char *paths[create_chunk];
+        void *buf;
+        if (posix_memalign(&buf, buffer_align, buffer_size) != 0) {
+                fputs("Failed to allocate the copy buffer\n", stderr);
+                return 0;
+        }
+        int first, last;
+        while (take(job, first, last)) {
+                for (int i = first; i < last; i++)
+                        paths[i - first] = job.items[i].vfs;
+                job.vfs->CreateBatch(paths, last - first);
+                for (int i = first; i < last; i++) {
+                        const Entry &e = job.items[i];
+                        if (!import_file(*job.vfs, e, (char*)buf)) {
+                                __sync_fetch_and_add(&job.failed, 1);
+                                continue;
+                        }
+                        __sync_fetch_and_add(&job.bytes, (uint64_t)e.size);
+                        __sync_fetch_and_add(&job.done, 1);
+                }
+        }
+        free(buf);
+        return 0;
+}
+
+static bool write_all(int fd, struct iovec *iov, int iovcnt, off_t pos)
+{
+        while (iovcnt > 0) {
+                ssize_t res = pwritev(fd, iov, iovcnt, pos);
+                if (res <= 0)
+                        return false;
+                pos += res;
+                for (; iovcnt > 0 && (size_t)res >= iov->iov_len; iov++) {
+                        res -= iov->iov_len;
+                        iovcnt--;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base = (char*)iov->iov_base + res;
+                        iov->iov_len -= res;
+                }
+        }
+        return true;
+}
+
+/* the data goes from the storage mapping to the host file with no copy
+ * in between, into space reserved for the known size */
+static bool copy_out(IVFS &vfs, File *f, int fd, off_t size)
+{
+        if (size > 0) {
+                int res = posix_fallocate(fd, 0, size);
+                if (res != 0 && res != EOPNOTSUPP && res != EINVAL) {
+                        errno = res;
+                        perror("posix_fallocate");
+                        return false;
+                }
+        }
+        FileView views[max_views];
+        struct iovec iov[max_views];
+        off_t pos = 0;
+        bool ok = true;
+        for (;;) {
+                int n = vfs.MapRange(f, pos, export_window, views, max_views);
+                if (n <= 0) {
+                        ok = n == 0;
+                        break;
+                }
+                size_t len = 0;
+                for (int i = 0; i < n; i++) {
+                        iov[i].iov_base = (void*)views[i].data;
+                        iov[i].iov_len = views[i].len;
+                        len += views[i].len;
+                }
+                ok = write_all(fd, iov, n, pos);
+                vfs.ReleaseViews(views, n);
+                if (!ok)
+                        break;
+                pos += len;
+        }
+        if (ok && pos != size && ftruncate(fd, pos) == -1)
+                ok = false;
+        return ok && fdatasync(fd) != -1;
+}
+
+static bool export_file(IVFS &vfs, Entry &e)
+{
+        File *f = vfs.Open(e.vfs, "r");
+        if (!f) {
+                fprintf(stderr, "Failed to open %s\n", e.vfs);
+                return false;
+        }
+        int fd = open(e.host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+                perror(e.host);
+        bool ok = fd != -1 && copy_out(vfs, f, fd, e.size);
+        if (ok)
+                e.size = vfs.Size(f);
+        else
+                fprintf(stderr, "Failed to export %s\n", e.vfs);
+        if (fd != -1)
+                close(fd);
+        vfs.Close(f);
+        return ok;
+}
+
+static void *export_files(void *arg)
+{
+        Job &job = *(Job*)arg;
+        int first, last;
+        while (take(job, first, last)) {
+                for (int i = first; i < last; i++) {
+                        Entry &e = job.items[i];
+                        if (!export_file(*job.vfs, e)) {
+                                __sync_fetch_and_add(&job.failed, 1);
+                                continue;
+                        }
+                        __sync_fetch_and_add(&job.bytes, (uint64_t)e.size);
+                        __sync_fetch_and_add(&job.done, 1);
+                }
+        }
+        return 0;
+}
+
+static void init_job(Job &job, IVFS &vfs, Entry *items, int count, int chunk)
+{
+        job.vfs = &vfs;
+        job.items = items;
+        job.count = count;
+        job.chunk = chunk;
+        job.next = 0;
+        job.done = 0;
+        job.failed = 0;
+        job.bytes = 0;
+}
+
+/* the directories of one depth are made together, after their parents */
+static int make_vfs_dirs(IVFS &vfs, EntryList &dirs, int workers,
+                         int &failed)
+{
+        qsort(dirs.items, dirs.count, sizeof(Entry), by_depth);
+        int made = 0;
+        failed = 0;
+        for (int i = 0, j; i < dirs.count; i = j) {
+                for (j = i; j < dirs.count; j++) {
+                        if (dirs.items[j].depth != dirs.items[i].depth)
+                                break;
+                }
+                int per_worker = (j - i + workers - 1) / workers;
+                Job job;
+                init_job(job, vfs, dirs.items + i, j - i,
+                         per_worker < create_chunk ? per_worker
+                                                   : create_chunk);
+                run_workers(job, create_dirs, workers);
+                made += job.done;
+                failed += job.failed;
+        }
+        return made;
+}
+
+static void report(const char *what, int dirs, const Job &job, double t)
+{
+        double mb = job.bytes / 1048576.0;
+        printf("%s: %d directories, %d files, %.1f MB in %.2f s "
+               "(%.1f MB/s, %.0f files/s)\n", what, dirs, job.done, mb, t,
+               t > 0 ? mb / t : 0, t > 0 ? job.done / t : 0);
+        if (job.failed)
+                printf("%d files failed\n", job.failed);
+}
+
+static int import_tree(IVFS &vfs, const char *host, const char *dest,
+                       int workers)
+{
+        struct stat st;
+        if (stat(host, &st) == -1 || !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "Not a directory: %s\n", host);
+                return 1;
+        }
+        double t = now();
+        EntryList dirs = { 0, 0, 0 }, files = { 0, 0, 0 };
+        int skipped = 0, dirs_failed;
+        if (strcmp(dest, "/")) {
+                add(dirs, strcpy(new char[strlen(host) + 1], host),
+                    strcpy(new char[strlen(dest) + 1], dest), 0, 0);
+        }
+        walk_host(host, dest, 1, dirs, files, skipped);
+        int made = make_vfs_dirs(vfs, dirs, workers, dirs_failed);
+        /* the largest files first, so the last ones to finish are short */
+        qsort(files.items, files.count, sizeof(Entry), by_size);
+        Job job;
+        init_job(job, vfs, files.items, files.count, file_chunk);
+        run_workers(job, import_files, workers);
+        vfs.Sync();
+        report("imported", made, job, now() - t);
+        if (dirs_failed)
+                printf("%d directories failed\n", dirs_failed);
+        if (skipped)
+                printf("%d host entries skipped\n", skipped);
+        free_list(dirs);
+        free_list(files);
+        return job.failed || dirs_failed ? 1 : 0;
+}
+
+static int export_tree(IVFS &vfs, const char *src, const char *host,
+                       int workers)
+{
+        double t = now();
+        EntryList dirs = { 0, 0, 0 }, files = { 0, 0, 0 };
+        if (!walk_vfs(vfs, src, host, 0, dirs, files))
+                return 1;
+        int made = 0, failed = 0;
+        if (mkdir(host, 0755) == -1 && errno != EEXIST) {
+                perror(host);
+                failed++;
+        }
+        /* dirs is in walk order, parents before their children */
+        for (int i = 0; i < dirs.count; i++) {
+                if (mkdir(dirs.items[i].host, 0755) == 0) {
+                        made++;
+                } else if (errno != EEXIST) {
+                        perror(dirs.items[i].host);
+                        failed++;
+                }
+        }
+        qsort(files.items, files.count, sizeof(Entry), by_size);
+        Job job;
+        init_job(job, vfs, files.items, files.count, file_chunk);
+        run_workers(job, export_files, workers);
+        report("exported", made, job, now() - t);
+        free_list(dirs);
+        free_list(files);
+        return job.failed || failed ? 1 : 0;
+}
+
+static void usage()
+{
+        fputs("usage: vfsctl [-j workers] [-m] work_dir import host_dir "
+              "vfs_dir\n"
+              "       vfsctl [-j workers] work_dir export vfs_dir host_dir\n"
+              "  -j  copy with that many threads (default 4)\n"
+              "  -m  make a new file system in work_dir first\n", stderr);
+}
+
+int main(int argc, char **argv)
+{
+        int workers = default_workers, opt;
+        bool makefs = false;
+        while ((opt = getopt(argc, argv, "j:m")) != -1) {
+                switch (opt) {
+                case 'j':
+                        workers = atoi(optarg);
+                        break;
+                case 'm':
+                        makefs = true;
+                        break;
+                default:
+                        usage();
+                        return 2;
+                }
+        }
+        argv += optind;
+        argc -= optind;
+        bool import = argc == 4 && !strcmp(argv[1], "import");
+        if (workers < 1 || (!import && (argc != 4 ||
+                                        strcmp(argv[1], "export")))) {
+                usage();
+                return 2;
+        }
+        IVFS vfs;
+        if (!vfs.Boot(argv[0], makefs))
+                return 1;
+        if (import)
+                return import_tree(vfs, argv[2], argv[3], workers);
+        return export_tree(vfs, argv[2], argv[3], workers);
+}
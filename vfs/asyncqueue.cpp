@@ -0,0 +1,130 @@
+#include "asyncqueue.hpp"
+#include "ivfs.hpp"
+
+AsyncQueue::AsyncQueue(IVFS &fs, int workers)
+        : vfs(fs), done_head(0), done_tail(0), in_flight(0)
+{
+        pthread_mutex_init(&mtx, 0);
+        pthread_cond_init(&cond, 0);
+        vfs.async_pool.Start(workers);
+}
+
+/* requests still running refer to the queue */
+AsyncQueue::~AsyncQueue()
+{
+        pthread_mutex_lock(&mtx);
+        while (in_flight > 0)
+                pthread_cond_wait(&cond, &mtx);
+        pthread_mutex_unlock(&mtx);
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mtx);
+}
+
+int AsyncQueue::Submit(AsyncRequest **reqs, int count)
+{
+        if (count <= 0)
+                return 0;
+        IOTask *tasks = new IOTask[count];
+        for (int i = 0; i < count; i++) {
+                reqs[i]->queue = this;
+                reqs[i]->next = 0;
+                reqs[i]->result = -1;
+                tasks[i].run = Execute;
+                tasks[i].arg = reqs[i];
+        }
+        pthread_mutex_lock(&mtx);
+        in_flight += count;
+        pthread_mutex_unlock(&mtx);
+        vfs.async_pool.Post(tasks, count);
+        delete[] tasks;
+        return count;
+}
+
+int AsyncQueue::Poll(AsyncRequest **done, int max)
+{
+        pthread_mutex_lock(&mtx);
+        int retval = Collect(done, max);
+        pthread_mutex_unlock(&mtx);
+        return retval;
+}
+
+/* returns fewer than min only when nothing is left in flight */
+int AsyncQueue::Wait(AsyncRequest **done, int min, int max)
+{
+        if (min > max)
+                min = max;
+        pthread_mutex_lock(&mtx);
+        int got = Collect(done, max);
+        while (got < min && in_flight > 0) {
+                pthread_cond_wait(&cond, &mtx);
+                got += Collect(done + got, max - got);
+        }
+        pthread_mutex_unlock(&mtx);
+        return got;
+}
+
+int AsyncQueue::InFlight()
+{
+        pthread_mutex_lock(&mtx);
+        int retval = in_flight;
+        pthread_mutex_unlock(&mtx);
+        return retval;
+}
+
+/* called under mtx */
+int AsyncQueue::Collect(AsyncRequest **done, int max)
+{
+        int got = 0;
+        while (got < max && done_head) {
+                done[got++] = done_head;
+                done_head = done_head->next;
+        }
+        if (!done_head)
+                done_tail = 0;
+        return got;
+}
+
+void AsyncQueue::Complete(AsyncRequest *req)
+{
+        pthread_mutex_lock(&mtx);
+        if (done_tail)
+                done_tail->next = req;
+        else
+                done_head = req;
+        done_tail = req;
+        in_flight--;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mtx);
+}
+
+/* runs on a worker of the pool */
+void AsyncQueue::Execute(void *arg)
+{
+        AsyncRequest *req = (AsyncRequest*)arg;
+        IVFS &vfs = req->queue->vfs;
+        switch (req->op) {
+        case async_open:
+                req->fp = vfs.Open(req->path, req->flags);
+                req->result = req->fp ? 0 : -1;
+                break;
+        case async_read:
+                if (req->offset < 0)
+                        req->result = vfs.Read(req->fp, req->buf, req->len);
+                else
+                        req->result = vfs.PRead(req->fp, req->buf, req->len,
+                                                req->offset);
+                break;
+        case async_write:
+                if (req->offset < 0)
+                        req->result = vfs.Write(req->fp, req->buf, req->len);
+                else
+                        req->result = vfs.PWrite(req->fp, req->buf, req->len,
+                                                 req->offset);
+                break;
+        case async_close:
+                vfs.Close(req->fp);
+                req->result = 0;
+                break;
+        }
+        req->queue->Complete(req);
+}
@@ -0,0 +1,63 @@
+#ifndef ASYNCQUEUE_HPP_SENTRY
+#define ASYNCQUEUE_HPP_SENTRY
+
+#include <pthread.h>
+#include <sys/types.h>
+
+class IVFS;
+class AsyncQueue;
+struct File;
+
+enum AsyncOp { async_open, async_read, async_write, async_close };
+
+/* One asynchronous call.  open fills fp and sets result to 0 (-1 when
+ * the file was not opened); read and write go to offset, or to the
+ * current position of the file when it is -1, and set result like
+ * PRead/PWrite do.  The request belongs to the queue from Submit() until
+ * Poll() or Wait() hands it back. */
+struct AsyncRequest {
+        int op;
+        const char *path;
+        const char *flags;
+        File *fp;
+        char *buf;
+        size_t len;
+        off_t offset;
+        ssize_t result;
+        void *user;
+private:
+        AsyncQueue *queue;
+        AsyncRequest *next;
+        friend class AsyncQueue;
+};
+
+/* Completion queue for requests run by the file system's worker pool.
+ * A thread (an event loop, say) keeps any number of requests in flight
+ * on its own queue: Submit() hands a batch over with one wakeup of the
+ * workers, Poll() collects finished ones without blocking and Wait()
+ * blocks until at least min have finished.  Requests with offset -1 on
+ * the same file move its position and must not be in flight together. */
+class AsyncQueue {
+        static const int default_workers = 4;
+        IVFS &vfs;
+        pthread_mutex_t mtx;
+        pthread_cond_t cond;
+        AsyncRequest *done_head;
+        AsyncRequest *done_tail;
+        int in_flight;
+public:
+        AsyncQueue(IVFS &fs, int workers = default_workers);
+        ~AsyncQueue();
+        int Submit(AsyncRequest **reqs, int count);
+        int Poll(AsyncRequest **done, int max);
+        int Wait(AsyncRequest **done, int min, int max);
+        int InFlight();
+private:
+        int Collect(AsyncRequest **done, int max);
+        void Complete(AsyncRequest *req);
+        static void Execute(void *arg);
+        AsyncQueue(const AsyncQueue&);
+        void operator=(const AsyncQueue&);
+};
+
+#endif /* ASYNCQUEUE_HPP_SENTRY */
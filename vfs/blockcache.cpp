@@ -0,0 +1,275 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include "blockcache.hpp"
+
+BlockCache::BlockCache() : shard_capacity(0), block_size(0)
+{
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                pthread_mutex_init(&sh.mtx, 0);
+                sh.table = 0;
+                sh.table_size = 0;
+                sh.used = 0;
+                sh.lru_head = 0;
+                sh.lru_tail = 0;
+                sh.free_list = 0;
+                sh.pending = 0;
+                sh.pending_used = 0;
+                memset(&sh.stats, 0, sizeof(sh.stats));
+        }
+}
+
+BlockCache::~BlockCache()
+{
+        Flush();
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                for (size_t j = 0; j < sh.table_size; j++) {
+                        while (sh.table[j]) {
+                                Entry *tmp = sh.table[j];
+                                sh.table[j] = tmp->hash_next;
+                                delete tmp;
+                        }
+                }
+                while (sh.free_list) {
+                        Entry *tmp = sh.free_list;
+                        sh.free_list = tmp->hash_next;
+                        delete tmp;
+                }
+                delete[] sh.table;
+                delete[] sh.pending;
+                pthread_mutex_destroy(&sh.mtx);
+        }
+}
+
+void BlockCache::Init(size_t capacity, size_t blk_size)
+{
+        if (capacity == 0)
+                capacity = default_capacity;
+        block_size = blk_size;
+        shard_capacity = (capacity + shards_amount - 1) / shards_amount;
+        size_t table_size = 1;
+        while (table_size < shard_capacity * 2)
+                table_size <<= 1;
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                sh.table = new Entry*[table_size];
+                sh.table_size = table_size;
+                memset(sh.table, 0, table_size * sizeof(Entry*));
+                sh.pending = new char*[pending_max];
+        }
+}
+
+void BlockCache::Pin(BlockAddress addr, char *data)
+{
+        Shard &sh = shards[Hash(addr) % shards_amount];
+        pthread_mutex_lock(&sh.mtx);
+        Entry **pe = Lookup(sh, addr);
+        if (*pe) {
+                Entry *e = *pe;
+                if (e->pins == 0)
+                        LruRemove(sh, e);
+                e->pins++;
+                sh.stats.hits++;
+                pthread_mutex_unlock(&sh.mtx);
+                return;
+        }
+        sh.stats.misses++;
+        if (sh.used >= shard_capacity && sh.lru_head)
+                Evict(sh);
+        Entry *e = sh.free_list;
+        if (e)
+                sh.free_list = e->hash_next;
+        else
+                e = new Entry;
+        e->addr = addr;
+        e->data = data;
+        e->pins = 1;
+        e->dirty = false;
+        e->lru_prev = 0;
+        e->lru_next = 0;
+        pe = Lookup(sh, addr);
+        e->hash_next = *pe;
+        *pe = e;
+        sh.used++;
+        pthread_mutex_unlock(&sh.mtx);
+}
+
+void BlockCache::Unpin(BlockAddress addr, bool dirty)
+{
+        Shard &sh = shards[Hash(addr) % shards_amount];
+        pthread_mutex_lock(&sh.mtx);
+        Entry *e = *Lookup(sh, addr);
+        if (!e || e->pins == 0) {
+                pthread_mutex_unlock(&sh.mtx);
+                fputs("BlockCache::Unpin(): block is not pinned\n", stderr);
+                return;
+        }
+        if (dirty)
+                e->dirty = true;
+        e->pins--;
+        if (e->pins == 0)
+                LruAppend(sh, e);
+        pthread_mutex_unlock(&sh.mtx);
+}
+
+void BlockCache::Forget(BlockAddress addr)
+{
+        Shard &sh = shards[Hash(addr) % shards_amount];
+        pthread_mutex_lock(&sh.mtx);
+        Entry **pe = Lookup(sh, addr);
+        Entry *e = *pe;
+        if (e && e->pins == 0) {
+                LruRemove(sh, e);
+                *pe = e->hash_next;
+                e->hash_next = sh.free_list;
+                sh.free_list = e;
+                sh.used--;
+        }
+        pthread_mutex_unlock(&sh.mtx);
+}
+
+/* A pinned block may be changed without being marked dirty yet, so it
+ * is written as well; writing a clean page costs next to nothing. */
+void BlockCache::Flush()
+{
+        size_t amount = 0, size = 0;
+        char **blocks = 0;
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                pthread_mutex_lock(&sh.mtx);
+                if (amount + sh.pending_used + sh.used > size) {
+                        size = (amount + sh.pending_used + sh.used) * 2;
+                        char **tmp = new char*[size];
+                        if (amount)
+                                memcpy(tmp, blocks, amount * sizeof(char*));
+                        delete[] blocks;
+                        blocks = tmp;
+                }
+                if (sh.pending_used)
+                        memcpy(blocks + amount, sh.pending,
+                               sh.pending_used * sizeof(char*));
+                amount += sh.pending_used;
+                sh.stats.writebacks += sh.pending_used;
+                sh.pending_used = 0;
+                for (size_t j = 0; j < sh.table_size; j++) {
+                        for (Entry *e = sh.table[j]; e; e = e->hash_next) {
+                                if (!e->dirty && e->pins == 0)
+                                        continue;
+                                if (e->dirty)
+                                        sh.stats.writebacks++;
+                                e->dirty = false;
+                                blocks[amount++] = e->data;
+                        }
+                }
+                pthread_mutex_unlock(&sh.mtx);
+        }
+        WriteBack(blocks, amount);
+        delete[] blocks;
+}
+
+BlockCacheStats BlockCache::Stats()
+{
+        BlockCacheStats total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                pthread_mutex_lock(&sh.mtx);
+                total.hits += sh.stats.hits;
+                total.misses += sh.stats.misses;
+                total.evictions += sh.stats.evictions;
+                total.writebacks += sh.stats.writebacks;
+                pthread_mutex_unlock(&sh.mtx);
+        }
+        return total;
+}
+
+void BlockCache::Evict(Shard &sh)
+{
+        Entry *e = sh.lru_head;
+        LruRemove(sh, e);
+        if (e->dirty) {
+                if (sh.pending_used == pending_max) {
+                        WriteBack(sh.pending, sh.pending_used);
+                        sh.stats.writebacks += sh.pending_used;
+                        sh.pending_used = 0;
+                }
+                sh.pending[sh.pending_used++] = e->data;
+        }
+        madvise(e->data, block_size, MADV_DONTNEED);
+        Entry **pe = Lookup(sh, e->addr);
+        *pe = e->hash_next;
+        e->hash_next = sh.free_list;
+        sh.free_list = e;
+        sh.used--;
+        sh.stats.evictions++;
+}
+
+/* writes the blocks, sorting them in place to msync each run of
+ * adjacent ones with one call */
+void BlockCache::WriteBack(char **blocks, size_t amount)
+{
+        qsort(blocks, amount, sizeof(*blocks), CompareBlocks);
+        size_t i = 0;
+        while (i < amount) {
+                char *end = blocks[i] + block_size;
+                size_t j = i + 1;
+                for (; j < amount && blocks[j] <= end; j++)
+                        end = blocks[j] + block_size;
+                if (msync(blocks[i], end - blocks[i], MS_SYNC) == -1)
+                        perror("BlockCache::WriteBack(): msync");
+                i = j;
+        }
+}
+
+int BlockCache::CompareBlocks(const void *a, const void *b)
+{
+        size_t x = (size_t)*(char * const *)a;
+        size_t y = (size_t)*(char * const *)b;
+        return x < y ? -1 : x > y;
+}
+
+void BlockCache::LruRemove(Shard &sh, Entry *e)
+{
+        if (e->lru_prev)
+                e->lru_prev->lru_next = e->lru_next;
+        else if (sh.lru_head == e)
+                sh.lru_head = e->lru_next;
+        else
+                return;
+        if (e->lru_next)
+                e->lru_next->lru_prev = e->lru_prev;
+        else
+                sh.lru_tail = e->lru_prev;
+        e->lru_prev = 0;
+        e->lru_next = 0;
+}
+
+void BlockCache::LruAppend(Shard &sh, Entry *e)
+{
+        e->lru_prev = sh.lru_tail;
+        e->lru_next = 0;
+        if (sh.lru_tail)
+                sh.lru_tail->lru_next = e;
+        else
+                sh.lru_head = e;
+        sh.lru_tail = e;
+}
+
+BlockCache::Entry **BlockCache::Lookup(Shard &sh, BlockAddress addr)
+{
+        size_t slot = (Hash(addr) / shards_amount) & (sh.table_size - 1);
+        Entry **pe = &sh.table[slot];
+        while (*pe && ((*pe)->addr.storage_num != addr.storage_num ||
+                       (*pe)->addr.block_num != addr.block_num))
+                pe = &(*pe)->hash_next;
+        return pe;
+}
+
+uint32_t BlockCache::Hash(BlockAddress addr)
+{
+        uint32_t h = addr.block_num * 2654435761u;
+        return h ^ (addr.storage_num * 40503u);
+}
@@ -0,0 +1,70 @@
+#ifndef BLOCKCACHE_HPP_SENTRY
+#define BLOCKCACHE_HPP_SENTRY
+
+#include <cstddef>
+#include <stdint.h>
+#include <pthread.h>
+#include "blockmanager.hpp"
+
+struct BlockCacheStats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t writebacks;
+};
+
+/* Bounded set of resident blocks of the storage mappings.  Every user of
+ * a block pins it for the time it works with the memory; unpinned blocks
+ * are kept on a per-shard LRU list and the coldest one is dropped from
+ * the mapping when the shard is full.  A dropped dirty block stays in the
+ * page cache and is remembered until Flush(), which writes the dirty,
+ * pinned and remembered blocks with MS_SYNC in runs of adjacent blocks;
+ * a shard remembering pending_max blocks writes them at once. */
+class BlockCache {
+        static const int shards_amount = 16;
+        static const size_t default_capacity = 4096;
+        static const size_t pending_max = 1024;
+        struct Entry {
+                BlockAddress addr;
+                char *data;
+                int pins;
+                bool dirty;
+                Entry *hash_next;
+                Entry *lru_prev;
+                Entry *lru_next;
+        };
+        struct Shard {
+                pthread_mutex_t mtx;
+                Entry **table;
+                size_t table_size;
+                size_t used;
+                Entry *lru_head;
+                Entry *lru_tail;
+                Entry *free_list;
+                char **pending;
+                size_t pending_used;
+                BlockCacheStats stats;
+        };
+        Shard shards[shards_amount];
+        size_t shard_capacity;
+        size_t block_size;
+public:
+        BlockCache();
+        ~BlockCache();
+        void Init(size_t capacity, size_t blk_size);
+        void Pin(BlockAddress addr, char *data);
+        void Unpin(BlockAddress addr, bool dirty);
+        void Forget(BlockAddress addr);
+        void Flush();
+        BlockCacheStats Stats();
+private:
+        void Evict(Shard &sh);
+        void WriteBack(char **blocks, size_t amount);
+        static int CompareBlocks(const void *a, const void *b);
+        static void LruRemove(Shard &sh, Entry *e);
+        static void LruAppend(Shard &sh, Entry *e);
+        static Entry **Lookup(Shard &sh, BlockAddress addr);
+        static uint32_t Hash(BlockAddress addr);
+};
+
+#endif /* BLOCKCACHE_HPP_SENTRY */
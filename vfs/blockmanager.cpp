@@ -5,58 +5,79 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include "blockmanager.hpp"
+#include "blockcache.hpp"
 #include "inodemanager.hpp"
 #include "ivfs.hpp"
 
-BlockManager::BlockManager() : bitmap(0), size(0), fd(-1)
+BlockManager::BlockManager(Journal &jrnl)
+        : storage_amount(0), storage_size(0), block_size(0), addr_in_block(0),
+        stripe_blocks(0), dir_fd(-1), bitmap(0), size(0), fd(-1), groups_amount(0),
+        journal(jrnl)
 {
-        printf("size = %ld\n", sizeof(BlockAddress));
+        memset(&geometry, 0, sizeof(geometry));
+        cache = new BlockCache;
         pthread_mutex_init(&mtx, 0);
-        for (uint32_t i = 0; i < storage_amount; i++) {
+        for (uint32_t i = 0; i < max_storage_amount; i++) {
                 storage_fds[i] = -1;
-                free_blocks[i] = 0;
+                storages[i] = 0;
+                storage_ends[i] = 0;
+                groups[i] = 0;
         }
 }
 
 BlockManager::~BlockManager()
 {
         pthread_mutex_destroy(&mtx);
+        delete cache;
         if (bitmap) {
-                msync(bitmap, size, MS_SYNC);
+                msync(bitmap, BitmapBytes(storage_amount), MS_SYNC);
                 munmap(bitmap, size);
         }
         if (fd != -1)
                 close(fd);
         for (uint32_t i = 0; i < storage_amount; i++) {
+                if (storages[i]) {
+                        msync(storages[i], storage_size * block_size, MS_SYNC);
+                        munmap(storages[i], storage_size * block_size);
+                }
                 if (storage_fds[i] != -1)
                         close(storage_fds[i]);
+                if (!groups[i])
+                        continue;
+                for (uint32_t g = 0; g < groups_amount; g++)
+                        pthread_mutex_destroy(&groups[i][g].mtx);
+                delete[] groups[i];
         }
 }
 
-bool BlockManager::Init(int dir_fd)
+bool BlockManager::Init(int dir, const Geometry &geom, size_t cache_size)
 {
-        void *p;
+        geometry = geom;
+        storage_size = geometry.storage_size;
+        block_size = geometry.block_size;
+        addr_in_block = block_size / sizeof(BlockAddress);
+        stripe_blocks = geometry.stripe_blocks;
+        groups_amount = (storage_size + group_blocks - 1) / group_blocks;
+        dir_fd = dir;
+        cache->Init(cache_size, block_size);
         fd = openat(dir_fd, "free_blocks", O_RDWR);
         if (fd == -1) {
                 perror("BlockManager::Init(): open");
                 return false;
         }
-        size = storage_size * storage_amount / 8;
-        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        /* room for every storage that may be added, the file itself only
+         * covers the existing ones */
+        size = BitmapBytes(max_storage_amount);
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
         if (p == MAP_FAILED) {
                 perror("BlockManager::Init(): mmap");
                 return false;
         }
         bitmap = (char*)p;
-        char storage_name[32];
-        for (uint32_t i = 0; i < storage_amount; i++) {
-                sprintf(storage_name, "storage%d", i);
-                free_blocks[i] = CalculateFreeBlocks(i);
-                storage_fds[i] = openat(dir_fd, storage_name, O_RDWR);
-                if (storage_fds[i] == -1) {
-                        perror("BlockManager::Init(): open");
+        for (uint32_t i = 0; i < geometry.storage_amount; i++) {
+                if (!OpenStorage(i))
                         return false;
-                }
+                storage_amount = i + 1;
         }
         return true;
 }
@@ -64,26 +85,70 @@ bool BlockManager::Init(int dir_fd)
 BlockAddress BlockManager::GetBlock(Inode *in, off_t num)
 {
         BlockAddress retval;
+        uint32_t run;
+        if (in->flags & inode_extents)
+                return GetExtentBlock(in, num, run);
         if (num < 8) {
                 retval = in->block[num];
         } else if (num >= 8 && num < 8 + addr_in_block) {
-                BlockAddress *lev1 = (BlockAddress*)ReadBlock(in->block[8]);
+                BlockAddress *lev1 = (BlockAddress*)PinBlock(in->block[8]);
                 retval = lev1[num - 8];
-                UnmapBlock(lev1);
+                UnpinBlock(lev1);
         } else {
                 off_t idx1 = (num - 8 - addr_in_block) / addr_in_block;
                 off_t idx0 = (num - 8 - addr_in_block) % addr_in_block;
-                BlockAddress *lev2 = (BlockAddress*)ReadBlock(in->block[9]);
-                BlockAddress *lev1 = (BlockAddress*)ReadBlock(lev2[idx1]);
+                BlockAddress *lev2 = (BlockAddress*)PinBlock(in->block[9]);
+                BlockAddress *lev1 = (BlockAddress*)PinBlock(lev2[idx1]);
                 retval = lev1[idx0];
-                UnmapBlock(lev1);
-                UnmapBlock(lev2);
+                UnpinBlock(lev1);
+                UnpinBlock(lev2);
+        }
+        return retval;
+}
+
+/* like GetBlock, also telling how many blocks from num on lie
+ * consecutively in the storage; in the indirect map the run ends with
+ * the map block holding num */
+BlockAddress BlockManager::GetRun(Inode *in, off_t num, uint32_t &run)
+{
+        BlockAddress retval;
+        run = 1;
+        if (in->flags & inode_extents)
+                return GetExtentBlock(in, num, run);
+        if (num >= in->blk_size)
+                return GetBlock(in, num);
+        off_t left = in->blk_size - num;
+        if (num < 8) {
+                if (left > 8 - num)
+                        left = 8 - num;
+                retval = MapRun(in->block + num, left, run);
+        } else if (num < 8 + addr_in_block) {
+                off_t idx0 = num - 8;
+                BlockAddress *lev1 = (BlockAddress*)PinBlock(in->block[8]);
+                if (left > addr_in_block - idx0)
+                        left = addr_in_block - idx0;
+                retval = MapRun(lev1 + idx0, left, run);
+                UnpinBlock(lev1);
+        } else {
+                off_t idx1 = (num - 8 - addr_in_block) / addr_in_block;
+                off_t idx0 = (num - 8 - addr_in_block) % addr_in_block;
+                BlockAddress *lev2 = (BlockAddress*)PinBlock(in->block[9]);
+                BlockAddress *lev1 = (BlockAddress*)PinBlock(lev2[idx1]);
+                if (left > addr_in_block - idx0)
+                        left = addr_in_block - idx0;
+                retval = MapRun(lev1 + idx0, left, run);
+                UnpinBlock(lev1);
+                UnpinBlock(lev2);
         }
         return retval;
 }
 
 BlockAddress BlockManager::AddBlock(Inode *in)
 {
+        if (!(in->flags & inode_extents) && in->blk_size == 0)
+                InitExtents(in);
+        if (in->flags & inode_extents)
+                return AddExtentBlock(in);
         BlockAddress new_block = AllocateBlock();
         if (in->blk_size < 8)
                 in->block[in->blk_size] = new_block;
@@ -95,70 +160,538 @@ BlockAddress BlockManager::AddBlock(Inode *in)
         return new_block;
 }
 
+/* appends up to count blocks in as few runs as the free space allows;
+ * returns how many were added */
+uint32_t BlockManager::AddBlocks(Inode *in, uint32_t count)
+{
+        uint32_t added = 0;
+        if (!(in->flags & inode_extents) && in->blk_size == 0)
+                InitExtents(in);
+        if (!(in->flags & inode_extents)) {
+                for (; added < count; added++) {
+                        BlockAddress addr = AddBlock(in);
+                        if (addr.block_num == 0xFFFFFFFF)
+                                break;
+                }
+                return added;
+        }
+        while (added < count) {
+                uint32_t storage, goal, got;
+                uint32_t want = ExtentGoal(in, storage, goal);
+                if (want > count - added)
+                        want = count - added;
+                BlockAddress start = AllocateRun(storage, goal, want, got);
+                if (got == 0)
+                        break;
+                if (!AppendRun(in, in->blk_size, start, got)) {
+                        FreeRun(start, got);
+                        break;
+                }
+                in->blk_size += got;
+                added += got;
+        }
+        return added;
+}
+
+/* gives each of count empty files its first block, taking them from as
+ * few runs as the free space allows so files made together lie side by
+ * side; returns how many got one */
+uint32_t BlockManager::AddFirstBlocks(Inode **ins, uint32_t count)
+{
+        uint32_t done = 0;
+        while (done < count) {
+                uint32_t got;
+                BlockAddress start = AllocateRun(storage_amount, 0,
+                                                 count - done, got);
+                for (uint32_t i = 0; i < got; i++, done++) {
+                        BlockAddress addr = start;
+                        addr.block_num += i;
+                        InitExtents(ins[done]);
+                        if (!AppendRun(ins[done], 0, addr, 1)) {
+                                FreeRun(addr, got - i);
+                                return done;
+                        }
+                        ins[done]->blk_size = 1;
+                }
+                if (got == 0)
+                        break;
+        }
+        return done;
+}
+
 void BlockManager::FreeBlocks(Inode *in)
 {
-        for (off_t i = 0; i < in->blk_size; i++)
-                FreeBlock(GetBlock(in, i));
-        if (in->blk_size > 8)
-                FreeBlock(in->block[8]);
-        if (in->blk_size > 8 + addr_in_block) {
-                BlockAddress *block_lev2 = (BlockAddress*)ReadBlock(in->block[9]);
-                off_t r = (in->blk_size - 8 - addr_in_block) / addr_in_block;
-                for (off_t i = 0; i < r + 1; i++)
-                        FreeBlock(block_lev2[i]);
-                UnmapBlock(block_lev2);
-                FreeBlock(in->block[9]);
+        if (in->flags & inode_extents) {
+                FreeExtentNode(ExtentRoot(in));
+                InitExtents(in);
+        } else {
+                for (off_t i = 0; i < in->blk_size; i++)
+                        FreeBlock(GetBlock(in, i));
+                FreeIndirectBlocks(in);
         }
         in->byte_size = 0;
         in->blk_size = 0;
 }
 
-void *BlockManager::ReadBlock(BlockAddress addr) const
+bool BlockManager::ConvertToExtents(Inode *in)
+{
+        if (in->flags & inode_extents)
+                return true;
+        off_t n = in->blk_size;
+        BlockAddress *map = new BlockAddress[n > 0 ? n : 1];
+        for (off_t i = 0; i < n; i++) {
+                map[i] = GetBlock(in, i);
+                if (map[i].storage_num >= storage_amount) {
+                        delete[] map;
+                        fputs("BlockManager::ConvertToExtents(): "
+                              "broken block map\n", stderr);
+                        return false;
+                }
+        }
+        FreeIndirectBlocks(in);
+        InitExtents(in);
+        bool retval = true;
+        for (off_t i = 0; i < n && retval; i++)
+                retval = AppendRun(in, i, map[i], 1);
+        delete[] map;
+        if (!retval)
+                fputs("BlockManager::ConvertToExtents(): "
+                      "failed to map the blocks\n", stderr);
+        return retval;
+}
+
+/* up to want blocks in a row, from goal in storage if it is free; the
+ * groups from the goal's one on (or the thread's own one) are tried
+ * without waiting for busy ones first, then waiting for each, before a
+ * storage is added */
+BlockAddress BlockManager::AllocateRun(uint32_t storage, uint32_t goal,
+                                       uint32_t want, uint32_t &got)
+{
+        BlockAddress addr;
+        addr.storage_num = storage_amount;
+        addr.block_num = 0xFFFFFFFF;
+        got = 0;
+        for (;;) {
+                uint32_t amount = storage_amount;
+                uint32_t total = amount * groups_amount;
+                uint32_t first = HomeGroup(0, amount);
+                if (storage < amount && goal < storage_size)
+                        first = storage * groups_amount + goal / group_blocks;
+                for (int pass = 0; pass < 2; pass++) {
+                        for (uint32_t i = 0; i < total; i++) {
+                                size_t local = FreeBitmap::npos;
+                                if (i == 0 && storage < amount &&
+                                    goal < storage_size)
+                                        local = goal % group_blocks;
+                                if (AllocateInGroup((first + i) % total, local,
+                                                    want, pass > 0 || i == 0,
+                                                    addr, got))
+                                        return addr;
+                        }
+                }
+                pthread_mutex_lock(&mtx);
+                bool grown = storage_amount > amount || AddStorage();
+                pthread_mutex_unlock(&mtx);
+                if (!grown)
+                        break;
+        }
+        fputs("BlockManager::AllocateRun(): no free blocks\n", stderr);
+        return addr;
+}
+
+void BlockManager::FreeRun(BlockAddress start, uint32_t count)
+{
+        if (start.storage_num >= storage_amount ||
+            start.block_num >= storage_size)
+                return;
+        if (count > storage_size - start.block_num)
+                count = storage_size - start.block_num;
+        for (uint32_t done = 0; done < count; ) {
+                uint32_t block = start.block_num + done;
+                Group &g = groups[start.storage_num][block / group_blocks];
+                uint32_t n = g.first + group_blocks - block;
+                if (n > count - done)
+                        n = count - done;
+                uint32_t freed = 0;
+                pthread_mutex_lock(&g.mtx);
+                for (uint32_t i = 0; i < n; i++) {
+                        if (!g.free_map.IsFree(block - g.first + i)) {
+                                g.free_map.Release(block - g.first + i);
+                                freed++;
+                        }
+                }
+                LogBitmap(start.storage_num, block, n);
+                journal.Revoke(Journal::storage_base + start.storage_num,
+                               (off_t)block * block_size, n * block_size);
+                __sync_fetch_and_add(&g.free, freed);
+                pthread_mutex_unlock(&g.mtx);
+                done += n;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+                BlockAddress addr = start;
+                addr.block_num += i;
+                cache->Forget(addr);
+        }
+}
+
+void *BlockManager::PinBlock(BlockAddress addr)
 {
-        void *ptr = mmap(0, block_size, PROT_READ | PROT_WRITE,
-                         MAP_SHARED, storage_fds[addr.storage_num],
-                         addr.block_num * block_size);
-        if (ptr == MAP_FAILED) {
-                perror("BlockManager::ReadBlock(): mmap");
+        if (addr.storage_num >= storage_amount ||
+            addr.block_num >= storage_size) {
+                fputs("BlockManager::PinBlock(): bad address\n", stderr);
                 return 0;
         }
+        char *ptr = storages[addr.storage_num] + addr.block_num * block_size;
+        cache->Pin(addr, ptr);
         return ptr;
 }
 
-void BlockManager::UnmapBlock(void *ptr) const
+void BlockManager::UnpinBlock(void *ptr, bool dirty)
 {
-        msync(ptr, block_size, MS_ASYNC);
-        munmap(ptr, block_size);
+        BlockAddress addr;
+        if (!ptr)
+                return;
+        if (!AddressOf(ptr, addr)) {
+                fputs("BlockManager::UnpinBlock(): bad pointer\n", stderr);
+                return;
+        }
+        cache->Unpin(addr, dirty);
 }
 
-BlockAddress BlockManager::AllocateBlock()
+/* unpins a changed directory or block map block, logging its image */
+void BlockManager::UnpinMetadata(void *ptr)
+{
+        LogMetadata(ptr, block_size);
+        UnpinBlock(ptr, true);
+}
+
+/* logs len changed bytes from ptr inside a pinned metadata block */
+void BlockManager::LogMetadata(const void *ptr, size_t len)
 {
         BlockAddress addr;
+        if (!ptr || !AddressOf(ptr, addr))
+                return;
+        off_t offset = (const char*)ptr - storages[addr.storage_num];
+        journal.Log(Journal::storage_base + addr.storage_num, offset,
+                    ptr, len);
+}
+
+/* unpins every block overlapping [ptr, ptr + len), which may run across
+ * consecutive blocks of a storage */
+void BlockManager::UnpinRange(const void *ptr, size_t len)
+{
+        const char *p = (const char*)ptr, *end = p + len;
+        while (p < end) {
+                BlockAddress addr;
+                if (!AddressOf(p, addr)) {
+                        fputs("BlockManager::UnpinRange(): bad pointer\n",
+                              stderr);
+                        return;
+                }
+                cache->Unpin(addr, false);
+                p = storages[addr.storage_num] +
+                    (addr.block_num + 1) * block_size;
+        }
+}
+
+/* pins the indirect map block holding the address of block num and
+ * tells which blocks it maps, so a reader stepping through the file can
+ * keep it instead of walking the map for every block; returns 0 for
+ * blocks addressed from the inode itself */
+BlockAddress *BlockManager::PinMapBlock(Inode *in, off_t num, off_t &first,
+                                        off_t &count)
+{
+        if ((in->flags & inode_extents) || num < 8 || num >= in->blk_size)
+                return 0;
+        BlockAddress *lev1;
+        if (num < 8 + addr_in_block) {
+                first = 8;
+                lev1 = (BlockAddress*)PinBlock(in->block[8]);
+        } else {
+                off_t idx1 = (num - 8 - addr_in_block) / addr_in_block;
+                first = 8 + addr_in_block + idx1 * addr_in_block;
+                BlockAddress *lev2 = (BlockAddress*)PinBlock(in->block[9]);
+                lev1 = lev2 ? (BlockAddress*)PinBlock(lev2[idx1]) : 0;
+                UnpinBlock(lev2);
+        }
+        count = in->blk_size - first;
+        if (count > addr_in_block)
+                count = addr_in_block;
+        return lev1;
+}
+
+/* asks the kernel to read count blocks of the file from num on ahead of
+ * use; returns how many blocks were covered */
+off_t BlockManager::Prefetch(Inode *in, off_t num, off_t count)
+{
+        off_t done = 0;
+        while (done < count && num + done < in->blk_size) {
+                uint32_t run;
+                BlockAddress addr = GetRun(in, num + done, run);
+                if (addr.storage_num >= storage_amount ||
+                    addr.block_num >= storage_size)
+                        break;
+                if (run > count - done)
+                        run = count - done;
+                madvise(storages[addr.storage_num] + addr.block_num * block_size,
+                        run * block_size, MADV_WILLNEED);
+                done += run;
+        }
+        return done;
+}
+
+void *BlockManager::PinRun(BlockAddress start, uint32_t count)
+{
+        if (start.storage_num >= storage_amount ||
+            start.block_num >= storage_size ||
+            count > storage_size - start.block_num) {
+                fputs("BlockManager::PinRun(): bad address\n", stderr);
+                return 0;
+        }
+        char *ptr = storages[start.storage_num] + start.block_num * block_size;
+        for (uint32_t i = 0; i < count; i++) {
+                BlockAddress addr = start;
+                addr.block_num += i;
+                cache->Pin(addr, ptr + i * block_size);
+        }
+        return ptr;
+}
+
+void BlockManager::UnpinRun(BlockAddress start, uint32_t count, bool dirty)
+{
+        for (uint32_t i = 0; i < count; i++) {
+                BlockAddress addr = start;
+                addr.block_num += i;
+                cache->Unpin(addr, dirty);
+        }
+}
+
+BlockCacheStats BlockManager::CacheStats() const
+{
+        return cache->Stats();
+}
+
+Geometry BlockManager::GetGeometry() const
+{
+        Geometry retval = geometry;
+        retval.storage_amount = storage_amount;
+        return retval;
+}
+
+/* everything written so far reaches the disk: the journal drops the
+ * images of directory and block map blocks once this returns.  Storage
+ * blocks are only changed while pinned, so the cache knows every one
+ * written since the last Sync and writes just those. */
+void BlockManager::Sync()
+{
+        cache->Flush();
         pthread_mutex_lock(&mtx);
-        uint32_t idx = MostFreeStorage();
-        addr.storage_num = idx;
-        addr.block_num = SearchFreeBlock(idx);
-        free_blocks[idx]--;
+        if (bitmap)
+                msync(bitmap, BitmapBytes(storage_amount), MS_SYNC);
         pthread_mutex_unlock(&mtx);
-        return addr;
 }
 
-void BlockManager::FreeBlock(BlockAddress addr)
+/* maps storage num, which must be covered by the bitmap file */
+bool BlockManager::OpenStorage(uint32_t num)
+{
+        char storage_name[32];
+        sprintf(storage_name, "storage%d", num);
+        /* bit k of byte k / 8 is bit k of the little endian word */
+        uint64_t *words = (uint64_t*)(bitmap + BitmapBytes(num));
+        groups[num] = new Group[groups_amount];
+        for (uint32_t i = 0; i < groups_amount; i++) {
+                Group &g = groups[num][i];
+                pthread_mutex_init(&g.mtx, 0);
+                g.first = i * group_blocks;
+                uint32_t bits = storage_size - g.first < group_blocks
+                              ? storage_size - g.first : group_blocks;
+                g.free_map.Attach(words + g.first / 64, bits);
+                g.free = g.free_map.CountFree();
+        }
+        storage_fds[num] = openat(dir_fd, storage_name, O_RDWR);
+        if (storage_fds[num] == -1) {
+                perror("BlockManager::OpenStorage(): open");
+                return false;
+        }
+        struct stat st;
+        if (fstat(storage_fds[num], &st) == -1) {
+                perror("BlockManager::OpenStorage(): fstat");
+                return false;
+        }
+        storage_ends[num] = st.st_size / block_size < storage_size
+                          ? st.st_size / block_size : storage_size;
+        void *p = mmap(0, storage_size * block_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, storage_fds[num], 0);
+        if (p == MAP_FAILED) {
+                perror("BlockManager::OpenStorage(): mmap");
+                return false;
+        }
+        storages[num] = (char*)p;
+        return true;
+}
+
+/* appends an empty storage once all are full; called under mtx */
+bool BlockManager::AddStorage()
+{
+        uint32_t num = storage_amount;
+        if (num >= max_storage_amount)
+                return false;
+        char storage_name[32];
+        sprintf(storage_name, "storage%d", num);
+        int sfd = openat(dir_fd, storage_name,
+                         O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (sfd == -1) {
+                perror("BlockManager::AddStorage(): open");
+                return false;
+        }
+        close(sfd);
+        if (ftruncate(fd, BitmapBytes(num + 1)) == -1) {
+                perror("BlockManager::AddStorage(): ftruncate");
+                return false;
+        }
+        memset(bitmap + BitmapBytes(num), 0xFF, BitmapBytes(1));
+        msync(bitmap, BitmapBytes(num + 1), MS_SYNC);
+        if (!OpenStorage(num))
+                return false;
+        Geometry grown = geometry;
+        grown.storage_amount = num + 1;
+        if (!Superblock::Write(dir_fd, grown))
+                return false;
+        geometry = grown;
+        /* lock-free readers check addresses against storage_amount */
+        __sync_synchronize();
+        storage_amount = num + 1;
+        return true;
+}
+
+/* makes sure blocks below end of storage num have disk space behind
+ * them, growing the file a chunk at a time */
+bool BlockManager::ExtendStorage(uint32_t num, uint32_t end)
 {
-        size_t idx = addr.storage_num * storage_size + addr.block_num;
+        if (end <= __sync_fetch_and_add(&storage_ends[num], 0))
+                return true;
         pthread_mutex_lock(&mtx);
-        bitmap[idx / 8] |= 0x1 << idx % 8;
-        free_blocks[addr.storage_num]++;
+        uint32_t old_end = __sync_fetch_and_add(&storage_ends[num], 0);
+        if (end <= old_end) {
+                pthread_mutex_unlock(&mtx);
+                return true;
+        }
+        uint32_t chunk = grow_chunk > block_size ? grow_chunk / block_size : 1;
+        uint32_t new_end = (end + chunk - 1) / chunk * chunk;
+        if (new_end > storage_size)
+                new_end = storage_size;
+        int res = posix_fallocate(storage_fds[num], (off_t)old_end * block_size,
+                                  (off_t)(new_end - old_end) * block_size);
+        if (res == 0)
+                __sync_lock_test_and_set(&storage_ends[num], new_end);
         pthread_mutex_unlock(&mtx);
+        if (res != 0) {
+                fprintf(stderr, "BlockManager::ExtendStorage(): %s\n",
+                        strerror(res));
+                return false;
+        }
+        return true;
+}
+
+/* takes up to want blocks from group index (counted over all storages),
+ * starting at goal within the group when it is free; gives up on a busy
+ * group unless told to wait */
+bool BlockManager::AllocateInGroup(uint32_t index, size_t goal, uint32_t want,
+                                   bool wait, BlockAddress &addr,
+                                   uint32_t &got)
+{
+        uint32_t storage = index / groups_amount;
+        Group &g = groups[storage][index % groups_amount];
+        if (__sync_fetch_and_add(&g.free, 0) == 0)
+                return false;
+        if (wait)
+                pthread_mutex_lock(&g.mtx);
+        else if (pthread_mutex_trylock(&g.mtx) != 0)
+                return false;
+        size_t n = 0, bit = FreeBitmap::npos;
+        if (__sync_fetch_and_add(&g.free, 0) > 0)
+                bit = g.free_map.AllocateRun(goal, want, n);
+        if (bit != FreeBitmap::npos &&
+            !ExtendStorage(storage, g.first + bit + n)) {
+                g.free_map.ReleaseRun(bit, n);
+                bit = FreeBitmap::npos;
+        }
+        if (bit != FreeBitmap::npos) {
+                LogBitmap(storage, g.first + bit, n);
+                __sync_fetch_and_sub(&g.free, n);
+        }
+        pthread_mutex_unlock(&g.mtx);
+        if (bit == FreeBitmap::npos)
+                return false;
+        addr.storage_num = storage;
+        addr.block_num = g.first + bit;
+        got = n;
+        return true;
+}
+
+/* The group a thread allocates from when a block has no goal, counted
+ * over all storages, picked among the groups of storages [first, first +
+ * amount) with disk space behind them and free blocks left.  Threads
+ * spread over the space the storages already have; once it is used up
+ * they all start where it ends, so the search in AllocateRun() grows the
+ * storages from their ends rather than here and there. */
+uint32_t BlockManager::HomeGroup(uint32_t first, uint32_t amount)
+{
+        uint32_t live = 0;
+        for (int pass = 0; pass < 2; pass++) {
+                uint32_t h = (uint32_t)((size_t)pthread_self() >> 12) *
+                             2654435761u;
+                uint32_t pick = live ? (h >> 16) % live : 0;
+                live = 0;
+                for (uint32_t s = first; s < first + amount; s++) {
+                        uint32_t end = __sync_fetch_and_add(&storage_ends[s],
+                                                            0);
+                        uint32_t n = (end + group_blocks - 1) / group_blocks;
+                        for (uint32_t i = 0; i < n && i < groups_amount; i++) {
+                                Group &g = groups[s][i];
+                                if (__sync_fetch_and_add(&g.free, 0) == 0)
+                                        continue;
+                                if (pass > 0 && live == pick)
+                                        return s * groups_amount + i;
+                                live++;
+                        }
+                }
+                if (live == 0)
+                        break;
+        }
+        uint32_t end = __sync_fetch_and_add(&storage_ends[first], 0);
+        uint32_t i = end / group_blocks;
+        return first * groups_amount + (i < groups_amount ? i : 0);
+}
+
+/* logs the bitmap words covering count blocks of a storage from block */
+void BlockManager::LogBitmap(uint32_t storage, uint32_t block, uint32_t count)
+{
+        size_t first = ((size_t)storage * storage_size + block) / 64;
+        size_t last = ((size_t)storage * storage_size + block + count - 1) / 64;
+        journal.Log(Journal::block_bitmap, first * sizeof(uint64_t),
+                    (uint64_t*)bitmap + first,
+                    (last - first + 1) * sizeof(uint64_t));
+}
+
+BlockAddress BlockManager::AllocateBlock()
+{
+        uint32_t got;
+        return AllocateRun(storage_amount, 0, 1, got);
+}
+
+void BlockManager::FreeBlock(BlockAddress addr)
+{
+        FreeRun(addr, 1);
 }
 
 void BlockManager::AddBlockToLev1(Inode *in, BlockAddress new_block)
 {
         if (in->blk_size == 8)
                 in->block[8] = AllocateBlock();
-        BlockAddress *block_lev1 = (BlockAddress*)ReadBlock(in->block[8]);
+        BlockAddress *block_lev1 = (BlockAddress*)PinBlock(in->block[8]);
         block_lev1[in->blk_size - 8] = new_block;
-        UnmapBlock(block_lev1);
+        UnpinMetadata(block_lev1);
 }
 
 void BlockManager::AddBlockToLev2(Inode *in, BlockAddress new_block)
@@ -167,56 +700,295 @@ void BlockManager::AddBlockToLev2(Inode *in, BlockAddress new_block)
         off_t lev0_num = (in->blk_size - 8 - addr_in_block) % addr_in_block;
         if (in->blk_size == 8 + addr_in_block)
                 in->block[9] = AllocateBlock();
-        BlockAddress *block_lev2 = (BlockAddress*)ReadBlock(in->block[9]);
+        BlockAddress *block_lev2 = (BlockAddress*)PinBlock(in->block[9]);
         if (lev0_num == 0)
                 block_lev2[lev1_num] = AllocateBlock();
-        BlockAddress *block_lev1 = (BlockAddress*)ReadBlock(block_lev2[lev1_num]);
+        BlockAddress *block_lev1 = (BlockAddress*)PinBlock(block_lev2[lev1_num]);
         block_lev1[lev0_num] = new_block;
-        UnmapBlock(block_lev1);
-        UnmapBlock(block_lev2);
+        UnpinMetadata(block_lev1);
+        if (lev0_num == 0)
+                UnpinMetadata(block_lev2);
+        else
+                UnpinBlock(block_lev2);
+}
+
+void BlockManager::FreeIndirectBlocks(Inode *in)
+{
+        if (in->blk_size > 8)
+                FreeBlock(in->block[8]);
+        if (in->blk_size > 8 + addr_in_block) {
+                BlockAddress *block_lev2 = (BlockAddress*)PinBlock(in->block[9]);
+                off_t r = (in->blk_size - 9) / addr_in_block;
+                for (off_t i = 0; i < r; i++)
+                        FreeBlock(block_lev2[i]);
+                UnpinBlock(block_lev2);
+                FreeBlock(in->block[9]);
+        }
 }
 
-uint32_t BlockManager::SearchFreeBlock(uint32_t idx) const
+BlockAddress BlockManager::GetExtentBlock(Inode *in, off_t num,
+                                          uint32_t &run)
 {
-        uint32_t blocks = storage_size / 8;
-        for (uint32_t i = blocks * idx; i < blocks * (idx + 1); i++) {
-                for (char mask = 0x1, j = 0; mask; mask <<= 1, j++) {
-                        if (bitmap[i] & mask) {
-                                bitmap[i] &= ~mask;
-                                return (i - blocks * idx) * 8 + j;
+        BlockAddress retval = { 0xFFFFFFFF, 0xFFFFFFFF };
+        ExtentHeader *node = ExtentRoot(in);
+        void *pinned = 0;
+        while (node) {
+                int i = FindEntry(node, num);
+                if (i < 0)
+                        break;
+                Extent *e = Entries(node) + i;
+                if (node->depth == 0) {
+                        if (num < (off_t)e->logical + e->length) {
+                                retval = e->start;
+                                retval.block_num += num - e->logical;
+                                run = e->logical + e->length - num;
                         }
+                        break;
+                }
+                void *child = PinBlock(e->start);
+                UnpinBlock(pinned);
+                pinned = child;
+                node = (ExtentHeader*)child;
+        }
+        UnpinBlock(pinned);
+        return retval;
+}
+
+BlockAddress BlockManager::AddExtentBlock(Inode *in)
+{
+        uint32_t storage, goal, got;
+        ExtentGoal(in, storage, goal);
+        BlockAddress new_block = AllocateRun(storage, goal, 1, got);
+        if (got == 0)
+                return new_block;
+        if (!AppendRun(in, in->blk_size, new_block, got)) {
+                FreeRun(new_block, got);
+                new_block.storage_num = new_block.block_num = 0xFFFFFFFF;
+                return new_block;
+        }
+        in->blk_size += got;
+        return new_block;
+}
+
+/* Where the file's next block should go: right after its last one to
+ * keep it contiguous.  In striping mode, a file past its first stripe
+ * unit starts each unit on the storage after the previous unit's one,
+ * next to where the file's unit on that storage ended.  Returns how many
+ * blocks may go there in a row. */
+uint32_t BlockManager::ExtentGoal(Inode *in, uint32_t &storage, uint32_t &goal)
+{
+        ExtentHeader *path[max_tree_depth + 1];
+        uint32_t logical = in->blk_size;
+        storage = storage_amount;
+        goal = 0;
+        if (stripe_blocks && logical >= stripe_blocks &&
+            logical % stripe_blocks == 0) {
+                uint32_t amount = storage_amount, run;
+                uint32_t unit = logical / stripe_blocks;
+                BlockAddress first = GetExtentBlock(in, 0, run);
+                storage = (first.storage_num + unit) % amount;
+                goal = HomeGroup(storage, 1) % groups_amount * group_blocks;
+                if (unit >= amount) {
+                        BlockAddress prev = GetExtentBlock(in,
+                                logical - amount * stripe_blocks, run);
+                        if (prev.storage_num == storage)
+                                goal = prev.block_num + stripe_blocks;
                 }
+                return stripe_blocks;
+        }
+        int depth = RightmostPath(in, path);
+        ExtentHeader *leaf = path[depth];
+        if (leaf && leaf->count > 0) {
+                Extent *last = Entries(leaf) + leaf->count - 1;
+                storage = last->start.storage_num;
+                goal = last->start.block_num + last->length;
         }
-        return 0xFFFFFFFF;
+        ReleasePath(path, depth, false);
+        if (!stripe_blocks)
+                return 0xFFFFFFFF;
+        return stripe_blocks - logical % stripe_blocks;
 }
 
-uint32_t BlockManager::CalculateFreeBlocks(uint32_t idx) const
+/* maps the run at logical; false when the extent tree can take no more,
+ * with the tree as it was and the run left to the caller */
+bool BlockManager::AppendRun(Inode *in, uint32_t logical,
+                             BlockAddress start, uint32_t len)
 {
-        uint32_t free_blocks = 0;
-        uint32_t blocks = storage_size / 8;
-        for (uint32_t i = blocks * idx; i < blocks * (idx + 1); i++) {
-                for (char mask = 0x1; mask; mask <<= 1) {
-                        if (bitmap[i] & mask)
-                                free_blocks++;
+        ExtentHeader *path[max_tree_depth + 1];
+        int depth = RightmostPath(in, path);
+        if (!path[depth]) {
+                ReleasePath(path, depth, false);
+                return false;
+        }
+        ExtentHeader *leaf = path[depth];
+        if (leaf->count > 0) {
+                Extent *last = Entries(leaf) + leaf->count - 1;
+                if (last->start.storage_num == start.storage_num &&
+                    last->start.block_num + last->length == start.block_num &&
+                    last->logical + last->length == logical) {
+                        last->length += len;
+                        ReleasePath(path, depth, true);
+                        return true;
                 }
         }
-        return free_blocks;
+        uint16_t node_max = (block_size - sizeof(ExtentHeader)) / sizeof(Extent);
+        Extent entry;
+        entry.logical = logical;
+        entry.length = len;
+        entry.start = start;
+        BlockAddress fresh_nodes[max_tree_depth + 1];
+        int fresh_amount = 0;
+        int level = depth;
+        for (; level > 0 && path[level]->count == path[level]->max; level--) {
+                BlockAddress addr = AllocateBlock();
+                ExtentHeader *fresh = (ExtentHeader*)PinBlock(addr);
+                if (!fresh)
+                        return DropNodes(path, depth, fresh_nodes,
+                                         fresh_amount);
+                fresh_nodes[fresh_amount++] = addr;
+                fresh->count = 1;
+                fresh->max = node_max;
+                fresh->depth = path[level]->depth;
+                fresh->unused = 0;
+                Entries(fresh)[0] = entry;
+                UnpinMetadata(fresh);
+                entry.length = 0;
+                entry.start = addr;
+        }
+        ExtentHeader *node = path[level];
+        if (node->count < node->max) {
+                Entries(node)[node->count++] = entry;
+                ReleasePath(path, depth, true);
+                return true;
+        }
+        /* the root is full, move it one level down into a block */
+        if (node->depth >= max_tree_depth) {
+                fputs("BlockManager::AppendRun(): extent tree full\n", stderr);
+                return DropNodes(path, depth, fresh_nodes, fresh_amount);
+        }
+        BlockAddress addr = AllocateBlock();
+        ExtentHeader *moved = (ExtentHeader*)PinBlock(addr);
+        if (!moved)
+                return DropNodes(path, depth, fresh_nodes, fresh_amount);
+        memcpy(moved, node, sizeof(*node) + node->count * sizeof(Extent));
+        moved->max = node_max;
+        Entries(moved)[moved->count++] = entry;
+        node->depth++;
+        node->count = 1;
+        Entries(node)[0].logical = Entries(moved)[0].logical;
+        Entries(node)[0].length = 0;
+        Entries(node)[0].start = addr;
+        UnpinMetadata(moved);
+        ReleasePath(path, depth, true);
+        return true;
+}
+
+/* gives back the nodes a failed AppendRun() allocated; the path itself
+ * was not changed */
+bool BlockManager::DropNodes(ExtentHeader **path, int depth,
+                             const BlockAddress *nodes, int count)
+{
+        ReleasePath(path, depth, false);
+        for (int i = 0; i < count; i++)
+                FreeBlock(nodes[i]);
+        return false;
 }
 
-uint32_t BlockManager::MostFreeStorage() const
+void BlockManager::FreeExtentNode(ExtentHeader *node)
 {
-        uint32_t max = free_blocks[0];
-        uint32_t idx = 0;
-        for (uint32_t i = 1; i < storage_amount; i++) {
-                if (free_blocks[i] > max) {
-                        max = free_blocks[i];
-                        idx = i;
+        Extent *e = Entries(node);
+        for (int i = 0; i < node->count; i++) {
+                if (node->depth == 0) {
+                        FreeRun(e[i].start, e[i].length);
+                        continue;
                 }
+                ExtentHeader *child = (ExtentHeader*)PinBlock(e[i].start);
+                if (child)
+                        FreeExtentNode(child);
+                UnpinBlock(child);
+                FreeBlock(e[i].start);
         }
-        return idx;
 }
 
-bool BlockManager::CreateFreeBlockArray(int dir_fd)
+int BlockManager::RightmostPath(Inode *in, ExtentHeader **path)
+{
+        int depth = 0;
+        path[0] = ExtentRoot(in);
+        while (path[depth] && path[depth]->depth > 0 &&
+               path[depth]->count > 0 && depth < max_tree_depth) {
+                Extent *last = Entries(path[depth]) + path[depth]->count - 1;
+                path[depth + 1] = (ExtentHeader*)PinBlock(last->start);
+                depth++;
+        }
+        return depth;
+}
+
+void BlockManager::ReleasePath(ExtentHeader **path, int depth, bool dirty)
+{
+        for (int i = depth; i > 0; i--) {
+                if (dirty)
+                        UnpinMetadata(path[i]);
+                else
+                        UnpinBlock(path[i]);
+        }
+}
+
+void BlockManager::InitExtents(Inode *in)
+{
+        memset(in->block, 0, sizeof(in->block));
+        ExtentHeader *root = ExtentRoot(in);
+        root->max = (sizeof(in->block) - sizeof(*root)) / sizeof(Extent);
+        in->flags |= inode_extents;
+}
+
+ExtentHeader *BlockManager::ExtentRoot(Inode *in)
+{
+        return (ExtentHeader*)in->block;
+}
+
+BlockAddress BlockManager::MapRun(const BlockAddress *map, off_t n,
+                                  uint32_t &run)
+{
+        run = 1;
+        while (run < n && map[run].storage_num == map[0].storage_num &&
+               map[run].block_num == map[0].block_num + run)
+                run++;
+        return map[0];
+}
+
+int BlockManager::FindEntry(ExtentHeader *node, uint32_t logical)
+{
+        Extent *e = Entries(node);
+        int lo = 0, hi = node->count - 1, retval = -1;
+        while (lo <= hi) {
+                int mid = (lo + hi) / 2;
+                if (e[mid].logical <= logical) {
+                        retval = mid;
+                        lo = mid + 1;
+                } else {
+                        hi = mid - 1;
+                }
+        }
+        return retval;
+}
+
+bool BlockManager::AddressOf(const void *ptr, BlockAddress &addr) const
+{
+        const char *p = (const char*)ptr;
+        for (uint32_t i = 0; i < storage_amount; i++) {
+                if (!storages[i] || p < storages[i])
+                        continue;
+                off_t offset = p - storages[i];
+                if (offset >= storage_size * block_size)
+                        continue;
+                addr.storage_num = i;
+                addr.block_num = offset / block_size;
+                return true;
+        }
+        return false;
+}
+
+bool BlockManager::CreateFreeBlockArray(int dir_fd, const Geometry &geometry)
 {
         int fd = openat(dir_fd, "free_blocks",
                         O_RDWR | O_CREAT | O_TRUNC, 0644);
@@ -224,7 +996,7 @@ bool BlockManager::CreateFreeBlockArray(int dir_fd)
                 perror("BlockManager::CreateFreeBlockArray(): open");
                 return false;
         }
-        size_t size = storage_amount * storage_size / 8;
+        size_t size = geometry.storage_amount * geometry.storage_size / 8;
         int res = ftruncate(fd, size);
         if (res == -1) {
                 perror("BlockManager::CreateFreeBlockArray(): ftruncate");
@@ -242,9 +1014,9 @@ bool BlockManager::CreateFreeBlockArray(int dir_fd)
         return true;
 }
 
-bool BlockManager::CreateBlockSpace(int dir_fd)
+bool BlockManager::CreateBlockSpace(int dir_fd, const Geometry &geometry)
 {
-        for (uint32_t i = 0; i < storage_amount; i++) {
+        for (uint32_t i = 0; i < geometry.storage_amount; i++) {
                 char storage_name[32];
                 sprintf(storage_name, "storage%d", i);
                 int fd = openat(dir_fd, storage_name,
@@ -253,14 +1025,7 @@ bool BlockManager::CreateBlockSpace(int dir_fd)
                         perror("BlockManager::CreateBlockSpace(): open");
                         return false;
                 }
-                size_t size = storage_size * block_size;
-                int res = ftruncate(fd, size);
-                if (res == -1) {
-                        perror("BlockManager::CreateBlockSpace(): ftruncate");
-                        return false;
-                }
                 close(fd);
         }
         return true;
 }
-
@@ -4,47 +4,147 @@
 #include <cstddef>
 #include <stdint.h>
 #include <pthread.h>
+#include "freebitmap.hpp"
+#include "superblock.hpp"
+#include "journal.hpp"
 
 struct Inode;
+struct BlockCacheStats;
+class BlockCache;
 
 #pragma pack(push, 1)
 struct BlockAddress {
         uint32_t storage_num;
         uint32_t block_num;
 };
+
+/* In extent mode Inode::block holds the root of an extent tree.  Leaf
+ * entries map length blocks starting at logical to consecutive blocks
+ * starting at start; index entries (length == 0) point to the child node
+ * covering blocks from logical. */
+struct ExtentHeader {
+        uint16_t count;
+        uint16_t max;
+        uint16_t depth;
+        uint16_t unused;
+};
+
+struct Extent {
+        uint32_t logical;
+        uint32_t length;
+        BlockAddress start;
+};
 #pragma pack(pop)
 
+/* Blocks live in storage files of storage_size blocks each, mapped whole
+ * at boot.  A storage file only gets disk space for the blocks handed out
+ * so far, extended grow_chunk bytes at a time; once every storage is
+ * full, another one is added and the superblock updated.  The free block
+ * bitmap is mapped for the largest possible number of storages and its
+ * file extended as they are added.
+ *
+ * Each storage is split into allocation groups of group_blocks blocks
+ * with their own lock, bitmap view and free counter.  A file grows in the
+ * group holding its last block; blocks with no such goal come from a
+ * group picked by the calling thread among the ones the storages already
+ * have disk space for, so parallel writers work in different groups
+ * without growing the storages ahead of need.  mtx only guards adding
+ * and extending storages. */
 class BlockManager {
-        static const uint32_t storage_amount = 4;
-        static const uint32_t storage_size = 16384;
-        static const off_t block_size = 4096;
-        static const off_t addr_in_block = block_size / sizeof(BlockAddress);
+        static const uint32_t max_storage_amount =
+                Superblock::max_storage_amount;
+        static const int max_tree_depth = 4;
+        static const off_t grow_chunk = 8 << 20;
+        static const uint32_t group_blocks = 4096;
+        struct Group {
+                pthread_mutex_t mtx;
+                FreeBitmap free_map;
+                uint32_t first;
+                uint32_t free;
+        };
+        Geometry geometry;
+        uint32_t storage_amount;
+        uint32_t storage_size;
+        off_t block_size;
+        off_t addr_in_block;
+        uint32_t stripe_blocks;
+        int dir_fd;
         char *bitmap;
         size_t size;
         int fd;
-        int storage_fds[storage_amount];
-        uint32_t free_blocks[storage_amount];
+        int storage_fds[max_storage_amount];
+        char *storages[max_storage_amount];
+        uint32_t storage_ends[max_storage_amount];
+        Group *groups[max_storage_amount];
+        uint32_t groups_amount;
+        BlockCache *cache;
+        Journal &journal;
         pthread_mutex_t mtx;
 public:
-        BlockManager();
+        BlockManager(Journal &jrnl);
         ~BlockManager();
-        bool Init(int dir_fd);
+        bool Init(int dir_fd, const Geometry &geometry, size_t cache_size = 0);
         BlockAddress GetBlock(Inode *in, off_t num);
+        BlockAddress GetRun(Inode *in, off_t num, uint32_t &run);
+        BlockAddress *PinMapBlock(Inode *in, off_t num, off_t &first,
+                                  off_t &count);
         BlockAddress AddBlock(Inode *in);
+        uint32_t AddBlocks(Inode *in, uint32_t count);
+        uint32_t AddFirstBlocks(Inode **ins, uint32_t count);
         void FreeBlocks(Inode *in);
-        void *ReadBlock(BlockAddress addr) const;
-        void UnmapBlock(void *ptr) const;
-        static bool CreateFreeBlockArray(int dir);
-        static bool CreateBlockSpace(int dir);
-        static off_t BlockSize() { return block_size; }
+        bool ConvertToExtents(Inode *in);
+        BlockAddress AllocateRun(uint32_t storage, uint32_t goal,
+                                 uint32_t want, uint32_t &got);
+        void FreeRun(BlockAddress start, uint32_t count);
+        void *PinBlock(BlockAddress addr);
+        void UnpinBlock(void *ptr, bool dirty = false);
+        void UnpinMetadata(void *ptr);
+        void LogMetadata(const void *ptr, size_t len);
+        void UnpinRange(const void *ptr, size_t len);
+        off_t Prefetch(Inode *in, off_t num, off_t count);
+        void *PinRun(BlockAddress start, uint32_t count);
+        void UnpinRun(BlockAddress start, uint32_t count, bool dirty = false);
+        BlockCacheStats CacheStats() const;
+        Geometry GetGeometry() const;
+        void Sync();
+        static bool CreateFreeBlockArray(int dir, const Geometry &geometry);
+        static bool CreateBlockSpace(int dir, const Geometry &geometry);
+        off_t BlockSize() const { return block_size; }
 private:
+        bool OpenStorage(uint32_t num);
+        bool AddStorage();
+        bool ExtendStorage(uint32_t num, uint32_t end);
+        size_t BitmapBytes(uint32_t amount) const {
+                return (size_t)amount * storage_size / 8;
+        }
+        bool AllocateInGroup(uint32_t index, size_t goal, uint32_t want,
+                             bool wait, BlockAddress &addr, uint32_t &got);
+        uint32_t HomeGroup(uint32_t first, uint32_t amount);
+        void LogBitmap(uint32_t storage, uint32_t block, uint32_t count);
         BlockAddress AllocateBlock();
         void FreeBlock(BlockAddress addr);
         void AddBlockToLev1(Inode *in, BlockAddress new_block);
         void AddBlockToLev2(Inode *in, BlockAddress new_block);
-        uint32_t SearchFreeBlock(uint32_t idx) const;
-        uint32_t CalculateFreeBlocks(uint32_t idx) const;
-        uint32_t MostFreeStorage() const;
+        void FreeIndirectBlocks(Inode *in);
+        BlockAddress GetExtentBlock(Inode *in, off_t num, uint32_t &run);
+        BlockAddress AddExtentBlock(Inode *in);
+        uint32_t ExtentGoal(Inode *in, uint32_t &storage, uint32_t &goal);
+        bool AppendRun(Inode *in, uint32_t logical,
+                       BlockAddress start, uint32_t len);
+        bool DropNodes(ExtentHeader **path, int depth,
+                       const BlockAddress *nodes, int count);
+        void FreeExtentNode(ExtentHeader *node);
+        int RightmostPath(Inode *in, ExtentHeader **path);
+        void ReleasePath(ExtentHeader **path, int depth, bool dirty);
+        static void InitExtents(Inode *in);
+        static ExtentHeader *ExtentRoot(Inode *in);
+        static Extent *Entries(ExtentHeader *node) {
+                return (Extent*)(node + 1);
+        }
+        static int FindEntry(ExtentHeader *node, uint32_t logical);
+        static BlockAddress MapRun(const BlockAddress *map, off_t n,
+                                   uint32_t &run);
+        bool AddressOf(const void *ptr, BlockAddress &addr) const;
 };
 
 #endif /* BLOCKMANAGER_HPP_SENTRY */
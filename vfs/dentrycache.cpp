@@ -0,0 +1,175 @@
+#include <cstring>
+#include "dentrycache.hpp"
+
+DentryCache::DentryCache() : shard_capacity(0)
+{
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                pthread_mutex_init(&sh.mtx, 0);
+                sh.table = 0;
+                sh.table_size = 0;
+                sh.used = 0;
+                sh.lru_head = 0;
+                sh.lru_tail = 0;
+                sh.free_list = 0;
+        }
+}
+
+DentryCache::~DentryCache()
+{
+        Clear();
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                while (sh.free_list) {
+                        Entry *tmp = sh.free_list;
+                        sh.free_list = tmp->hash_next;
+                        delete tmp;
+                }
+                delete[] sh.table;
+                pthread_mutex_destroy(&sh.mtx);
+        }
+}
+
+void DentryCache::Init(size_t capacity)
+{
+        if (capacity == 0)
+                capacity = default_capacity;
+        shard_capacity = (capacity + shards_amount - 1) / shards_amount;
+        size_t table_size = 1;
+        while (table_size < shard_capacity)
+                table_size <<= 1;
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                delete[] sh.table;
+                sh.table = new Entry*[table_size];
+                sh.table_size = table_size;
+                memset(sh.table, 0, table_size * sizeof(Entry*));
+        }
+}
+
+bool DentryCache::Lookup(int parent, const char *name, int &idx)
+{
+        uint32_t hash = Hash(parent, name);
+        Shard &sh = ShardFor(hash);
+        if (!sh.table)
+                return false;
+        pthread_mutex_lock(&sh.mtx);
+        Entry *e = *Find(sh, parent, name, hash);
+        if (e) {
+                idx = e->idx;
+                LruRemove(sh, e);
+                LruAppend(sh, e);
+        }
+        pthread_mutex_unlock(&sh.mtx);
+        return e != 0;
+}
+
+void DentryCache::Insert(int parent, const char *name, int idx)
+{
+        uint32_t hash = Hash(parent, name);
+        Shard &sh = ShardFor(hash);
+        if (!sh.table || strlen(name) > (size_t)DirManager::max_name_len)
+                return;
+        pthread_mutex_lock(&sh.mtx);
+        Entry **pe = Find(sh, parent, name, hash);
+        if (*pe) {
+                (*pe)->idx = idx;
+                pthread_mutex_unlock(&sh.mtx);
+                return;
+        }
+        if (sh.used >= shard_capacity && sh.lru_head) {
+                Entry *old = sh.lru_head;
+                Unlink(sh, Find(sh, old->parent, old->name, old->hash));
+        }
+        Entry *e = sh.free_list;
+        if (e)
+                sh.free_list = e->hash_next;
+        else
+                e = new Entry;
+        e->parent = parent;
+        e->idx = idx;
+        e->hash = hash;
+        strcpy(e->name, name);
+        pe = &sh.table[(hash / shards_amount) & (sh.table_size - 1)];
+        e->hash_next = *pe;
+        *pe = e;
+        LruAppend(sh, e);
+        sh.used++;
+        pthread_mutex_unlock(&sh.mtx);
+}
+
+void DentryCache::Invalidate(int parent, const char *name)
+{
+        uint32_t hash = Hash(parent, name);
+        Shard &sh = ShardFor(hash);
+        if (!sh.table)
+                return;
+        pthread_mutex_lock(&sh.mtx);
+        Entry **pe = Find(sh, parent, name, hash);
+        if (*pe)
+                Unlink(sh, pe);
+        pthread_mutex_unlock(&sh.mtx);
+}
+
+void DentryCache::Clear()
+{
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                pthread_mutex_lock(&sh.mtx);
+                for (size_t j = 0; j < sh.table_size; j++) {
+                        while (sh.table[j])
+                                Unlink(sh, &sh.table[j]);
+                }
+                pthread_mutex_unlock(&sh.mtx);
+        }
+}
+
+DentryCache::Entry **DentryCache::Find(Shard &sh, int parent,
+                                       const char *name, uint32_t hash)
+{
+        Entry **pe = &sh.table[(hash / shards_amount) & (sh.table_size - 1)];
+        while (*pe && ((*pe)->hash != hash || (*pe)->parent != parent ||
+                       strcmp((*pe)->name, name)))
+                pe = &(*pe)->hash_next;
+        return pe;
+}
+
+void DentryCache::Unlink(Shard &sh, Entry **pe)
+{
+        Entry *e = *pe;
+        *pe = e->hash_next;
+        LruRemove(sh, e);
+        e->hash_next = sh.free_list;
+        sh.free_list = e;
+        sh.used--;
+}
+
+void DentryCache::LruRemove(Shard &sh, Entry *e)
+{
+        if (e->lru_prev)
+                e->lru_prev->lru_next = e->lru_next;
+        else
+                sh.lru_head = e->lru_next;
+        if (e->lru_next)
+                e->lru_next->lru_prev = e->lru_prev;
+        else
+                sh.lru_tail = e->lru_prev;
+        e->lru_prev = 0;
+        e->lru_next = 0;
+}
+
+void DentryCache::LruAppend(Shard &sh, Entry *e)
+{
+        e->lru_prev = sh.lru_tail;
+        e->lru_next = 0;
+        if (sh.lru_tail)
+                sh.lru_tail->lru_next = e;
+        else
+                sh.lru_head = e;
+        sh.lru_tail = e;
+}
+
+uint32_t DentryCache::Hash(int parent, const char *name)
+{
+        return DirManager::NameHash(name) ^ (uint32_t)parent * 2654435761u;
+}
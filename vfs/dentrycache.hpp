@@ -0,0 +1,56 @@
+#ifndef DENTRYCACHE_HPP_SENTRY
+#define DENTRYCACHE_HPP_SENTRY
+
+#include <cstddef>
+#include <stdint.h>
+#include <pthread.h>
+#include "dirmanager.hpp"
+
+/* Maps (directory inode, name) to the inode of the entry, or to -1 for
+ * names known to be absent.  Entries are dropped when the directory
+ * record changes; shards evict their least recently used entry when
+ * full. */
+class DentryCache {
+        static const int shards_amount = 16;
+        static const size_t default_capacity = 65536;
+        struct Entry {
+                int parent;
+                int idx;
+                uint32_t hash;
+                char name[DirManager::max_name_len + 1];
+                Entry *hash_next;
+                Entry *lru_prev;
+                Entry *lru_next;
+        };
+        struct Shard {
+                pthread_mutex_t mtx;
+                Entry **table;
+                size_t table_size;
+                size_t used;
+                Entry *lru_head;
+                Entry *lru_tail;
+                Entry *free_list;
+        };
+        Shard shards[shards_amount];
+        size_t shard_capacity;
+public:
+        DentryCache();
+        ~DentryCache();
+        void Init(size_t capacity = 0);
+        bool Lookup(int parent, const char *name, int &idx);
+        void Insert(int parent, const char *name, int idx);
+        void Invalidate(int parent, const char *name);
+        void Clear();
+private:
+        Shard &ShardFor(uint32_t hash) {
+                return shards[hash % shards_amount];
+        }
+        static Entry **Find(Shard &sh, int parent, const char *name,
+                            uint32_t hash);
+        static void Unlink(Shard &sh, Entry **pe);
+        static void LruRemove(Shard &sh, Entry *e);
+        static void LruAppend(Shard &sh, Entry *e);
+        static uint32_t Hash(int parent, const char *name);
+};
+
+#endif /* DENTRYCACHE_HPP_SENTRY */
@@ -0,0 +1,28 @@
+asyncqueue.o: asyncqueue.cpp asyncqueue.hpp ivfs.hpp inodemanager.hpp \
+ blockmanager.hpp freebitmap.hpp superblock.hpp journal.hpp \
+ blockcache.hpp dirmanager.hpp dentrycache.hpp openfiletable.hpp \
+ iopool.hpp
+blockcache.o: blockcache.cpp blockcache.hpp blockmanager.hpp \
+ freebitmap.hpp superblock.hpp journal.hpp
+blockmanager.o: blockmanager.cpp blockmanager.hpp freebitmap.hpp \
+ superblock.hpp journal.hpp blockcache.hpp inodemanager.hpp ivfs.hpp \
+ dirmanager.hpp dentrycache.hpp openfiletable.hpp iopool.hpp \
+ asyncqueue.hpp
+dentrycache.o: dentrycache.cpp dentrycache.hpp dirmanager.hpp \
+ inodemanager.hpp blockmanager.hpp freebitmap.hpp superblock.hpp \
+ journal.hpp
+dirmanager.o: dirmanager.cpp dirmanager.hpp inodemanager.hpp \
+ blockmanager.hpp freebitmap.hpp superblock.hpp journal.hpp
+freebitmap.o: freebitmap.cpp freebitmap.hpp
+inodemanager.o: inodemanager.cpp inodemanager.hpp blockmanager.hpp \
+ freebitmap.hpp superblock.hpp journal.hpp ivfs.hpp blockcache.hpp \
+ dirmanager.hpp dentrycache.hpp openfiletable.hpp iopool.hpp \
+ asyncqueue.hpp
+iopool.o: iopool.cpp iopool.hpp
+ivfs.o: ivfs.cpp ivfs.hpp inodemanager.hpp blockmanager.hpp \
+ freebitmap.hpp superblock.hpp journal.hpp blockcache.hpp dirmanager.hpp \
+ dentrycache.hpp openfiletable.hpp iopool.hpp asyncqueue.hpp
+journal.o: journal.cpp journal.hpp superblock.hpp
+openfiletable.o: openfiletable.cpp openfiletable.hpp inodemanager.hpp \
+ blockmanager.hpp freebitmap.hpp superblock.hpp journal.hpp
+superblock.o: superblock.cpp superblock.hpp
@@ -0,0 +1,434 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "dirmanager.hpp"
+
+bool DirManager::InitDirectory(Inode *dir)
+{
+        BlockAddress index_addr = bm.AddBlock(dir);
+        BlockAddress bucket_addr = bm.AddBlock(dir);
+        DirIndex *index = (DirIndex*)bm.PinBlock(index_addr);
+        BucketHeader *bucket = (BucketHeader*)bm.PinBlock(bucket_addr);
+        if (!index || !bucket) {
+                bm.UnpinBlock(index);
+                bm.UnpinBlock(bucket);
+                fputs("DirManager::InitDirectory(): no space\n", stderr);
+                return false;
+        }
+        memset(index, 0, bm.BlockSize());
+        memset(bucket, 0, bm.BlockSize());
+        size_t entries = (bm.BlockSize() - sizeof(DirIndex)) / sizeof(uint32_t);
+        index->magic = index_magic;
+        index->depth = 0;
+        while (((size_t)2 << index->max_depth) <= entries)
+                index->max_depth++;
+        index->buckets = 1;
+        IndexEntries(index)[0] = 1;
+        bm.UnpinMetadata(bucket);
+        bm.UnpinMetadata(index);
+        dir->flags |= inode_hashed_dir;
+        return true;
+}
+
+int DirManager::Lookup(int dir_idx, const char *name)
+{
+        Inode dir;
+        im.ReadInode(&dir, dir_idx);
+        if (!dir.is_dir) {
+                fprintf(stderr, "%d not directory\n", dir_idx);
+                return -1;
+        }
+        uint32_t format = Format(&dir);
+        if (format != index_magic)
+                return LegacyLookup(&dir, format, name);
+        return HashedLookup(&dir, name);
+}
+
+bool DirManager::Insert(int dir_idx, const char *name, int idx)
+{
+        return InsertBatch(dir_idx, &name, &idx, 1) == 1;
+}
+
+/* inserts count entries with one read and one write of the directory
+ * inode; stops at the first that fails and returns how many went in */
+int DirManager::InsertBatch(int dir_idx, const char * const *names,
+                            const int *idxs, int count)
+{
+        Inode dir;
+        im.ReadInode(&dir, dir_idx);
+        if (Format(&dir) != index_magic) {
+                if (!Convert(dir_idx))
+                        return 0;
+                im.ReadInode(&dir, dir_idx);
+        }
+        int done = 0;
+        while (done < count && HashedInsert(&dir, names[done], idxs[done]))
+                done++;
+        im.WriteInode(&dir, dir_idx);
+        return done;
+}
+
+bool DirManager::Remove(int dir_idx, const char *name)
+{
+        Inode dir;
+        im.ReadInode(&dir, dir_idx);
+        if (Format(&dir) != index_magic) {
+                if (!Convert(dir_idx))
+                        return false;
+                im.ReadInode(&dir, dir_idx);
+        }
+        return HashedRemove(&dir, name);
+}
+
+bool DirManager::Convert(int dir_idx)
+{
+        Inode dir;
+        im.ReadInode(&dir, dir_idx);
+        if (!dir.is_dir)
+                return false;
+        uint32_t format = Format(&dir);
+        if (format == index_magic)
+                return true;
+        DirRecordList *ls = LegacyList(&dir, format);
+        Inode fresh = dir;
+        memset(fresh.block, 0, sizeof(fresh.block));
+        fresh.flags = 0;
+        fresh.byte_size = 0;
+        fresh.blk_size = 0;
+        bool res = InitDirectory(&fresh);
+        for (DirRecordList *tmp = ls; tmp && res; tmp = tmp->next)
+                res = HashedInsert(&fresh, tmp->filename, tmp->inode_idx);
+        FreeList(ls);
+        if (!res) {
+                fprintf(stderr, "Failed to convert directory %d\n", dir_idx);
+                bm.FreeBlocks(&fresh);
+                return false;
+        }
+        bm.FreeBlocks(&dir);
+        im.WriteInode(&fresh, dir_idx);
+        return true;
+}
+
+DirRecordList *DirManager::List(Inode *dir)
+{
+        DirRecordList *retval = 0;
+        uint32_t format = Format(dir);
+        if (format != index_magic)
+                return LegacyList(dir, format);
+        for (off_t i = 1; i < dir->blk_size; i++) {
+                BucketHeader *bucket = (BucketHeader*)PinLogical(dir, i);
+                if (!bucket)
+                        continue;
+                char *p = Entries(bucket), *end = p + bucket->used;
+                while (p < end) {
+                        DirEntry *e = (DirEntry*)p;
+                        char *filename = (char*)malloc(e->name_len + 1);
+                        memcpy(filename, e->name, e->name_len);
+                        filename[e->name_len] = 0;
+                        DirRecordList *tmp = new DirRecordList;
+                        tmp->filename = filename;
+                        tmp->inode_idx = e->inode;
+                        tmp->next = retval;
+                        retval = tmp;
+                        p += EntrySize(e->name_len);
+                }
+                bm.UnpinBlock(bucket);
+        }
+        return retval;
+}
+
+void DirManager::FreeList(DirRecordList *ptr)
+{
+        while (ptr) {
+                DirRecordList *tmp = ptr;
+                ptr = ptr->next;
+                free((void*)tmp->filename);
+                delete tmp;
+        }
+}
+
+uint32_t DirManager::NameHash(const char *name)
+{
+        uint32_t h = 2166136261u;
+        for (; *name; name++) {
+                h ^= (unsigned char)*name;
+                h *= 16777619u;
+        }
+        return h;
+}
+
+int DirManager::HashedLookup(Inode *dir, const char *name)
+{
+        int retval = -1;
+        uint32_t hash = NameHash(name);
+        size_t len = strlen(name);
+        uint32_t blk = BucketFor(dir, hash);
+        while (blk && retval == -1) {
+                BucketHeader *bucket = (BucketHeader*)PinLogical(dir, blk);
+                if (!bucket)
+                        break;
+                DirEntry *e = FindEntry(bucket, name, len, hash);
+                if (e)
+                        retval = e->inode;
+                blk = bucket->next;
+                bm.UnpinBlock(bucket);
+        }
+        return retval;
+}
+
+bool DirManager::HashedInsert(Inode *dir, const char *name, int idx)
+{
+        uint32_t hash = NameHash(name);
+        size_t len = strlen(name);
+        size_t size = EntrySize(len);
+        if (len > (size_t)max_name_len)
+                return false;
+        for (;;) {
+                uint32_t first = BucketFor(dir, hash);
+                uint32_t blk = first, last = first;
+                while (blk) {
+                        BucketHeader *bucket = (BucketHeader*)PinLogical(dir, blk);
+                        if (!bucket)
+                                return false;
+                        if (bucket->used + size <= BucketCapacity()) {
+                                DirEntry *e = (DirEntry*)(Entries(bucket) +
+                                                          bucket->used);
+                                e->inode = idx;
+                                e->hash = hash;
+                                e->name_len = len;
+                                memcpy(e->name, name, len);
+                                bucket->used += size;
+                                bucket->count++;
+                                bm.LogMetadata(bucket, sizeof(*bucket));
+                                bm.LogMetadata(e, size);
+                                bm.UnpinBlock(bucket, true);
+                                return true;
+                        }
+                        last = blk;
+                        blk = bucket->next;
+                        bm.UnpinBlock(bucket);
+                }
+                DirIndex *index = PinIndex(dir);
+                if (!index)
+                        return false;
+                BucketHeader *bucket = (BucketHeader*)PinLogical(dir, first);
+                bool can_split = bucket->local_depth < index->max_depth;
+                bm.UnpinBlock(bucket);
+                bool res = can_split ? SplitBucket(dir, index, first)
+                                     : AddOverflow(dir, last);
+                bm.UnpinMetadata(index);
+                if (!res)
+                        return false;
+        }
+}
+
+bool DirManager::HashedRemove(Inode *dir, const char *name)
+{
+        uint32_t hash = NameHash(name);
+        size_t len = strlen(name);
+        uint32_t blk = BucketFor(dir, hash);
+        while (blk) {
+                BucketHeader *bucket = (BucketHeader*)PinLogical(dir, blk);
+                if (!bucket)
+                        return false;
+                DirEntry *e = FindEntry(bucket, name, len, hash);
+                if (e) {
+                        char *next = (char*)e + EntrySize(len);
+                        char *end = Entries(bucket) + bucket->used;
+                        memmove(e, next, end - next);
+                        bucket->used -= next - (char*)e;
+                        bucket->count--;
+                        bm.LogMetadata(bucket, sizeof(*bucket));
+                        bm.LogMetadata(e, end - (char*)e);
+                        bm.UnpinBlock(bucket, true);
+                        return true;
+                }
+                blk = bucket->next;
+                bm.UnpinBlock(bucket);
+        }
+        return false;
+}
+
+bool DirManager::SplitBucket(Inode *dir, DirIndex *index, uint32_t blk)
+{
+        uint32_t *entries = IndexEntries(index);
+        BucketHeader *bucket = (BucketHeader*)PinLogical(dir, blk);
+        uint16_t ld = bucket->local_depth;
+        bm.UnpinBlock(bucket);
+        if (ld == index->depth) {
+                uint32_t half = 1u << index->depth;
+                memcpy(entries + half, entries, half * sizeof(uint32_t));
+                index->depth++;
+        }
+        uint32_t new_blk = dir->blk_size;
+        BlockAddress addr = bm.AddBlock(dir);
+        BucketHeader *fresh = (BucketHeader*)bm.PinBlock(addr);
+        if (!fresh || dir->blk_size != (off_t)new_blk + 1) {
+                bm.UnpinBlock(fresh);
+                fputs("DirManager::SplitBucket(): no space\n", stderr);
+                return false;
+        }
+        memset(fresh, 0, bm.BlockSize());
+        bucket = (BucketHeader*)PinLogical(dir, blk);
+        bucket->local_depth = ld + 1;
+        fresh->local_depth = ld + 1;
+        char *keep = new char[BucketCapacity()];
+        size_t kept = 0;
+        char *p = Entries(bucket), *end = p + bucket->used;
+        while (p < end) {
+                DirEntry *e = (DirEntry*)p;
+                size_t size = EntrySize(e->name_len);
+                if (e->hash >> ld & 1) {
+                        memcpy(Entries(fresh) + fresh->used, e, size);
+                        fresh->used += size;
+                        fresh->count++;
+                } else {
+                        memcpy(keep + kept, e, size);
+                        kept += size;
+                }
+                p += size;
+        }
+        memcpy(Entries(bucket), keep, kept);
+        bucket->used = kept;
+        bucket->count -= fresh->count;
+        delete[] keep;
+        for (uint32_t i = 0; i < (1u << index->depth); i++) {
+                if (entries[i] == blk && (i >> ld & 1))
+                        entries[i] = new_blk;
+        }
+        index->buckets++;
+        bm.UnpinMetadata(bucket);
+        bm.UnpinMetadata(fresh);
+        return true;
+}
+
+bool DirManager::AddOverflow(Inode *dir, uint32_t blk)
+{
+        uint32_t new_blk = dir->blk_size;
+        BlockAddress addr = bm.AddBlock(dir);
+        BucketHeader *fresh = (BucketHeader*)bm.PinBlock(addr);
+        if (!fresh || dir->blk_size != (off_t)new_blk + 1) {
+                bm.UnpinBlock(fresh);
+                fputs("DirManager::AddOverflow(): no space\n", stderr);
+                return false;
+        }
+        BucketHeader *bucket = (BucketHeader*)PinLogical(dir, blk);
+        memset(fresh, 0, bm.BlockSize());
+        fresh->local_depth = bucket->local_depth;
+        bucket->next = new_blk;
+        bm.UnpinMetadata(bucket);
+        bm.UnpinMetadata(fresh);
+        return true;
+}
+
+uint32_t DirManager::Format(Inode *dir)
+{
+        if (!(dir->flags & inode_hashed_dir))
+                return 0;
+        DirIndex *index = (DirIndex*)PinLogical(dir, 0);
+        if (!index)
+                return 0;
+        uint32_t magic = index->magic;
+        bm.UnpinBlock(index);
+        return magic;
+}
+
+int DirManager::LegacyLookup(Inode *dir, uint32_t format, const char *name)
+{
+        int retval = -1;
+        for (off_t i = format ? 1 : 0; i < dir->blk_size && retval == -1; i++) {
+                void *block = PinLogical(dir, i);
+                if (!block)
+                        break;
+                size_t n;
+                DirRecord *arr = LegacyRecords(block, format, n);
+                for (size_t j = 0; j < n; j++) {
+                        if (arr[j].name[0] && !strcmp(arr[j].name, name)) {
+                                retval = atoi(arr[j].idx);
+                                break;
+                        }
+                }
+                bm.UnpinBlock(block);
+        }
+        return retval;
+}
+
+DirRecordList *DirManager::LegacyList(Inode *dir, uint32_t format)
+{
+        DirRecordList *retval = 0;
+        for (off_t i = format ? 1 : 0; i < dir->blk_size; i++) {
+                void *block = PinLogical(dir, i);
+                if (!block)
+                        continue;
+                size_t n;
+                DirRecord *arr = LegacyRecords(block, format, n);
+                for (size_t j = 0; j < n; j++) {
+                        if (!arr[j].name[0])
+                                continue;
+                        DirRecordList *tmp = new DirRecordList;
+                        tmp->filename = strdup(arr[j].name);
+                        tmp->inode_idx = atoi(arr[j].idx);
+                        tmp->next = retval;
+                        retval = tmp;
+                }
+                bm.UnpinBlock(block);
+        }
+        return retval;
+}
+
+DirManager::DirRecord *DirManager::LegacyRecords(void *block, uint32_t format,
+                                                 size_t &n)
+{
+        if (format == index_magic_v1) {
+                n = (bm.BlockSize() - sizeof(BucketHeaderV1)) / sizeof(DirRecord);
+                return (DirRecord*)((BucketHeaderV1*)block + 1);
+        }
+        n = bm.BlockSize() / sizeof(DirRecord);
+        return (DirRecord*)block;
+}
+
+DirManager::DirIndex *DirManager::PinIndex(Inode *dir)
+{
+        DirIndex *index = (DirIndex*)PinLogical(dir, 0);
+        if (index && index->magic != index_magic) {
+                fputs("DirManager: broken directory index\n", stderr);
+                bm.UnpinBlock(index);
+                return 0;
+        }
+        return index;
+}
+
+void *DirManager::PinLogical(Inode *dir, uint32_t blk)
+{
+        return bm.PinBlock(bm.GetBlock(dir, blk));
+}
+
+uint32_t DirManager::BucketFor(Inode *dir, uint32_t hash)
+{
+        DirIndex *index = PinIndex(dir);
+        if (!index)
+                return 0;
+        uint32_t blk = IndexEntries(index)[hash & ((1u << index->depth) - 1)];
+        bm.UnpinBlock(index);
+        return blk;
+}
+
+size_t DirManager::BucketCapacity() const
+{
+        return bm.BlockSize() - sizeof(BucketHeader);
+}
+
+DirManager::DirEntry *DirManager::FindEntry(BucketHeader *bucket,
+                                            const char *name, size_t len,
+                                            uint32_t hash)
+{
+        char *p = Entries(bucket), *end = p + bucket->used;
+        while (p < end) {
+                DirEntry *e = (DirEntry*)p;
+                if (e->hash == hash && e->name_len == len &&
+                    !memcmp(e->name, name, len))
+                        return e;
+                p += EntrySize(e->name_len);
+        }
+        return 0;
+}
@@ -0,0 +1,108 @@
+#ifndef DIRMANAGER_HPP_SENTRY
+#define DIRMANAGER_HPP_SENTRY
+
+#include <cstddef>
+#include <stdint.h>
+#include "inodemanager.hpp"
+#include "blockmanager.hpp"
+
+struct DirRecordList {
+        const char *filename;
+        int32_t inode_idx;
+        DirRecordList *next;
+};
+
+/* Directory contents.  Hashed directories (inode flag inode_hashed_dir)
+ * keep an extendible hash index in block 0: the low depth bits of the
+ * name hash select a bucket block, a full bucket is split in two and the
+ * index doubled when needed.  Once the index can not grow any more, full
+ * buckets get overflow blocks chained to them.  Buckets hold packed
+ * binary entries carrying the inode number, the name hash and the name
+ * length, so a scan compares hash and length before the name itself.
+ *
+ * Older layouts, the flat array of text records and hashed directories
+ * with text records (index_magic_v1), are still readable; a directory in
+ * one of them is converted to the current layout on its first change or
+ * by Convert(). */
+class DirManager {
+public:
+        static const int max_name_len = 52;
+private:
+        static const uint32_t index_magic_v1 = 0x48444958;
+        static const uint32_t index_magic = 0x32494448;
+#pragma pack(push, 8)
+        struct DirRecord {
+                char name[max_name_len + 1];
+                char idx[8];
+        };
+#pragma pack(pop)
+#pragma pack(push, 1)
+        struct DirEntry {
+                uint32_t inode;
+                uint32_t hash;
+                uint8_t name_len;
+                char name[1];
+        };
+#pragma pack(pop)
+        struct DirIndex {
+                uint32_t magic;
+                uint16_t depth;
+                uint16_t max_depth;
+                uint32_t buckets;
+                uint32_t unused;
+        };
+        struct BucketHeader {
+                uint16_t local_depth;
+                uint16_t count;
+                uint32_t next;
+                uint32_t used;
+                uint32_t unused;
+        };
+        struct BucketHeaderV1 {
+                uint16_t local_depth;
+                uint16_t count;
+                uint32_t next;
+        };
+        InodeManager &im;
+        BlockManager &bm;
+public:
+        DirManager(InodeManager &imgr, BlockManager &bmgr)
+                : im(imgr), bm(bmgr) {}
+        bool InitDirectory(Inode *dir);
+        int Lookup(int dir_idx, const char *name);
+        bool Insert(int dir_idx, const char *name, int idx);
+        int InsertBatch(int dir_idx, const char * const *names,
+                        const int *idxs, int count);
+        bool Remove(int dir_idx, const char *name);
+        bool Convert(int dir_idx);
+        DirRecordList *List(Inode *dir);
+        static void FreeList(DirRecordList *ptr);
+        static uint32_t NameHash(const char *name);
+private:
+        int HashedLookup(Inode *dir, const char *name);
+        bool HashedInsert(Inode *dir, const char *name, int idx);
+        bool HashedRemove(Inode *dir, const char *name);
+        bool SplitBucket(Inode *dir, DirIndex *index, uint32_t blk);
+        bool AddOverflow(Inode *dir, uint32_t blk);
+        uint32_t Format(Inode *dir);
+        int LegacyLookup(Inode *dir, uint32_t format, const char *name);
+        DirRecordList *LegacyList(Inode *dir, uint32_t format);
+        DirRecord *LegacyRecords(void *block, uint32_t format, size_t &n);
+        DirIndex *PinIndex(Inode *dir);
+        void *PinLogical(Inode *dir, uint32_t blk);
+        uint32_t BucketFor(Inode *dir, uint32_t hash);
+        static uint32_t *IndexEntries(DirIndex *index) {
+                return (uint32_t*)(index + 1);
+        }
+        static char *Entries(BucketHeader *bucket) {
+                return (char*)(bucket + 1);
+        }
+        static size_t EntrySize(size_t name_len) {
+                return (offsetof(DirEntry, name) + name_len + 3) & ~3;
+        }
+        size_t BucketCapacity() const;
+        static DirEntry *FindEntry(BucketHeader *bucket, const char *name,
+                                   size_t len, uint32_t hash);
+};
+
+#endif /* DIRMANAGER_HPP_SENTRY */
@@ -0,0 +1,198 @@
+#include <cstring>
+#include "freebitmap.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FREEBITMAP_AVX2 1
+#endif
+
+FreeBitmap::FreeBitmap()
+        : words(0), summary(0), nbits(0), nwords(0), cursor(0)
+{
+}
+
+FreeBitmap::~FreeBitmap()
+{
+        delete[] summary;
+}
+
+void FreeBitmap::Attach(uint64_t *ptr, size_t bits)
+{
+        words = ptr;
+        nbits = bits;
+        nwords = (bits + 63) / 64;
+        cursor = 0;
+        if (bits % 64)
+                words[nwords - 1] &= ((uint64_t)1 << bits % 64) - 1;
+        size_t summary_words = (nwords + 63) / 64;
+        delete[] summary;
+        summary = new uint64_t[summary_words];
+        memset(summary, 0, summary_words * sizeof(uint64_t));
+        size_t w = BitmapNextNonZero(words, 0, nwords);
+        while (w < nwords) {
+                summary[w / 64] |= (uint64_t)1 << w % 64;
+                w = BitmapNextNonZero(words, w + 1, nwords);
+        }
+}
+
+size_t FreeBitmap::Allocate()
+{
+        size_t got;
+        return AllocateRun(npos, 1, got);
+}
+
+size_t FreeBitmap::AllocateRun(size_t goal, size_t want, size_t &got)
+{
+        size_t start = goal;
+        got = 0;
+        if (!IsFree(start)) {
+                start = FindFree(cursor);
+                if (start == npos && cursor > 0)
+                        start = FindFree(0);
+                if (start == npos)
+                        return npos;
+        }
+        while (got < want && IsFree(start + got)) {
+                Take(start + got);
+                got++;
+        }
+        cursor = start + got < nbits ? start + got : 0;
+        return start;
+}
+
+void FreeBitmap::Release(size_t bit)
+{
+        if (bit >= nbits)
+                return;
+        size_t w = bit / 64;
+        words[w] |= (uint64_t)1 << bit % 64;
+        summary[w / 64] |= (uint64_t)1 << w % 64;
+}
+
+void FreeBitmap::ReleaseRun(size_t first, size_t count)
+{
+        for (size_t i = 0; i < count; i++)
+                Release(first + i);
+}
+
+bool FreeBitmap::IsFree(size_t bit) const
+{
+        return bit < nbits && (words[bit / 64] >> bit % 64 & 1);
+}
+
+size_t FreeBitmap::CountFree() const
+{
+        return BitmapCount(words, nwords);
+}
+
+void FreeBitmap::Take(size_t bit)
+{
+        size_t w = bit / 64;
+        words[w] &= ~((uint64_t)1 << bit % 64);
+        if (!words[w])
+                summary[w / 64] &= ~((uint64_t)1 << w % 64);
+}
+
+size_t FreeBitmap::FindFree(size_t from) const
+{
+        if (from >= nbits)
+                return npos;
+        size_t w = from / 64;
+        uint64_t m = words[w] & (~(uint64_t)0 << from % 64);
+        if (m)
+                return w * 64 + __builtin_ctzll(m);
+        w++;
+        if (w >= nwords)
+                return npos;
+        size_t summary_words = (nwords + 63) / 64;
+        size_t s = w / 64;
+        m = summary[s] & (~(uint64_t)0 << w % 64);
+        while (!m) {
+                s = BitmapNextNonZero(summary, s + 1, summary_words);
+                if (s >= summary_words)
+                        return npos;
+                m = summary[s];
+        }
+        w = s * 64 + __builtin_ctzll(m);
+        return w * 64 + __builtin_ctzll(words[w]);
+}
+
+#ifdef FREEBITMAP_AVX2
+__attribute__((target("avx2")))
+static size_t next_non_zero_avx2(const uint64_t *words, size_t from,
+                                 size_t nwords)
+{
+        size_t i = from;
+        for (; i + 4 <= nwords; i += 4) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(words + i));
+                if (!_mm256_testz_si256(v, v))
+                        break;
+        }
+        for (; i < nwords; i++) {
+                if (words[i])
+                        return i;
+        }
+        return nwords;
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(const uint64_t *words, size_t nwords)
+{
+        const __m256i lookup = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low_mask = _mm256_set1_epi8(0x0F);
+        __m256i acc = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 4 <= nwords; i += 4) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(words + i));
+                __m256i lo = _mm256_and_si256(v, low_mask);
+                __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                              low_mask);
+                __m256i cnt = _mm256_add_epi8(
+                        _mm256_shuffle_epi8(lookup, lo),
+                        _mm256_shuffle_epi8(lookup, hi));
+                acc = _mm256_add_epi64(acc,
+                        _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+        }
+        uint64_t part[4];
+        _mm256_storeu_si256((__m256i*)part, acc);
+        size_t count = part[0] + part[1] + part[2] + part[3];
+        for (; i < nwords; i++)
+                count += __builtin_popcountll(words[i]);
+        return count;
+}
+
+static bool have_avx2()
+{
+        static int state = -1;
+        if (state == -1)
+                state = __builtin_cpu_supports("avx2") ? 1 : 0;
+        return state == 1;
+}
+#endif
+
+size_t BitmapCount(const uint64_t *words, size_t nwords)
+{
+#ifdef FREEBITMAP_AVX2
+        if (have_avx2())
+                return count_avx2(words, nwords);
+#endif
+        size_t count = 0;
+        for (size_t i = 0; i < nwords; i++)
+                count += __builtin_popcountll(words[i]);
+        return count;
+}
+
+size_t BitmapNextNonZero(const uint64_t *words, size_t from, size_t nwords)
+{
+#ifdef FREEBITMAP_AVX2
+        if (from < nwords && nwords - from >= 16 && have_avx2())
+                return next_non_zero_avx2(words, from, nwords);
+#endif
+        for (size_t i = from; i < nwords; i++) {
+                if (words[i])
+                        return i;
+        }
+        return nwords;
+}
@@ -0,0 +1,41 @@
+#ifndef FREEBITMAP_HPP_SENTRY
+#define FREEBITMAP_HPP_SENTRY
+
+#include <cstddef>
+#include <stdint.h>
+
+/* Allocation bitmap over externally owned words (usually a mapped file),
+ * bit set means the object is free.  An in-memory summary keeps one bit
+ * per word which is cleared once all 64 objects of the word are taken,
+ * so a search skips fully allocated groups 4096 objects at a time.
+ * Searches are next-fit from the position of the last allocation.
+ * The class does no locking, callers serialize access. */
+class FreeBitmap {
+        uint64_t *words;
+        uint64_t *summary;
+        size_t nbits;
+        size_t nwords;
+        size_t cursor;
+public:
+        static const size_t npos = (size_t)-1;
+        FreeBitmap();
+        ~FreeBitmap();
+        void Attach(uint64_t *ptr, size_t bits);
+        size_t Allocate();
+        size_t AllocateRun(size_t goal, size_t want, size_t &got);
+        void Release(size_t bit);
+        void ReleaseRun(size_t first, size_t count);
+        bool IsFree(size_t bit) const;
+        size_t CountFree() const;
+        size_t Size() const { return nbits; }
+private:
+        size_t FindFree(size_t from) const;
+        void Take(size_t bit);
+        FreeBitmap(const FreeBitmap&);
+        void operator=(const FreeBitmap&);
+};
+
+size_t BitmapCount(const uint64_t *words, size_t nwords);
+size_t BitmapNextNonZero(const uint64_t *words, size_t from, size_t nwords);
+
+#endif /* FREEBITMAP_HPP_SENTRY */
@@ -2,124 +2,260 @@
 #include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include "inodemanager.hpp"
 #include "ivfs.hpp"
 
-InodeManager::InodeManager()
+InodeManager::InodeManager(Journal &jrnl)
+        : max_file_amount(0), bitmap_words(0), inodes_fd(-1), bitmap_fd(-1),
+        bitmap(0),
+        table(0), table_size(0), dirty_pages(0), dirty_size(0), journal(jrnl)
 {
         pthread_mutex_init(&gf_mtx, 0);
-        pthread_mutex_init(&rw_mtx, 0);
-        for (int i = 0; i < inodes_cache_size; i++)
-                inodes_cache[i] = -1;
-        cache_used = inodes_cache_size;
-        inodes_fd = -1;
+        for (int i = 0; i < locks_amount; i++)
+                pthread_mutex_init(&rw_mtx[i], 0);
 }
 
 InodeManager::~InodeManager()
 {
+        Sync();
         pthread_mutex_destroy(&gf_mtx);
-        pthread_mutex_destroy(&rw_mtx);
+        for (int i = 0; i < locks_amount; i++)
+                pthread_mutex_destroy(&rw_mtx[i]);
+        if (table)
+                munmap(table, table_size);
+        if (bitmap)
+                munmap(bitmap, bitmap_words * sizeof(uint64_t));
+        delete[] dirty_pages;
         if (inodes_fd != -1)
                 close(inodes_fd);
+        if (bitmap_fd != -1)
+                close(bitmap_fd);
 }
 
-bool InodeManager::Init(int dir_fd)
+bool InodeManager::Init(int dir_fd, const Geometry &geometry)
 {
+        max_file_amount = geometry.max_file_amount;
+        bitmap_words = (max_file_amount + 63) / 64;
         inodes_fd = openat(dir_fd, "inode_space", O_RDWR);
         if (inodes_fd == -1) {
                 perror("InodeManager::Init(): open");
                 return false;
         }
-        SearchFreeInodes();
+        table_size = (size_t)max_file_amount * sizeof(Inode);
+        void *p = mmap(0, table_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, inodes_fd, 0);
+        if (p == MAP_FAILED) {
+                perror("InodeManager::Init(): mmap");
+                return false;
+        }
+        table = (Inode*)p;
+        dirty_size = ((table_size + page_size - 1) / page_size + 7) / 8;
+        dirty_pages = new unsigned char[dirty_size];
+        memset(dirty_pages, 0, dirty_size);
+        if (!OpenFreeInodeArray(dir_fd))
+                return false;
+        free_map.Attach(bitmap, max_file_amount);
         return true;
 }
 
 uint32_t InodeManager::GetInode()
 {
-        uint32_t retval = -1;
+        uint32_t idx;
+        return GetInodes(&idx, 1) ? idx : (uint32_t)-1;
+}
+
+/* takes up to count free inodes under one lock, returns how many */
+uint32_t InodeManager::GetInodes(uint32_t *idxs, uint32_t count)
+{
+        uint32_t got = 0;
         Inode in;
         memset(&in, 0, sizeof(in));
         in.is_busy = true;
         pthread_mutex_lock(&gf_mtx);
-        if (cache_used == inodes_cache_size)
-                SearchFreeInodes();
-        if (cache_used < inodes_cache_size) {
-                retval = inodes_cache[cache_used];
-                cache_used++;
+        for (; got < count; got++) {
+                size_t bit = free_map.Allocate();
+                if (bit == FreeBitmap::npos)
+                        break;
+                idxs[got] = bit;
+                WriteInode(&in, bit);
+                /* a bitmap word is logged once the batch leaves it */
+                if (got > 0 && idxs[got - 1] / 64 != bit / 64)
+                        LogBitmap(idxs[got - 1]);
         }
-        WriteInode(&in, retval);
+        if (got > 0)
+                LogBitmap(idxs[got - 1]);
         pthread_mutex_unlock(&gf_mtx);
-        return retval;
+        return got;
 }
 
 void InodeManager::FreeInode(uint32_t idx)
 {
         Inode in;
+        if (idx == 0 || idx >= max_file_amount)
+                return;
         memset(&in, 0, sizeof(in));
         pthread_mutex_lock(&gf_mtx);
         WriteInode(&in, idx);
-        if (cache_used > 0) {
-                cache_used--;
-                inodes_cache[cache_used] = idx;
-        }
+        free_map.Release(idx);
+        LogBitmap(idx);
         pthread_mutex_unlock(&gf_mtx);
 }
 
 bool InodeManager::ReadInode(Inode *ptr, uint32_t idx)
 {
-        int res;
-        pthread_mutex_lock(&rw_mtx);
-        res = lseek(inodes_fd, idx * sizeof(Inode), SEEK_SET);
-        if (res == -1) {
-                pthread_mutex_unlock(&rw_mtx);
+        if (!table || idx >= max_file_amount)
                 return false;
-        }
-        res = read(inodes_fd, ptr, sizeof(Inode));
-        pthread_mutex_unlock(&rw_mtx);
-        return res == sizeof(Inode);
+        pthread_mutex_t *lock = &rw_mtx[idx % locks_amount];
+        pthread_mutex_lock(lock);
+        memcpy(ptr, &table[idx], sizeof(Inode));
+        pthread_mutex_unlock(lock);
+        return true;
 }
 
 bool InodeManager::WriteInode(const Inode *ptr, uint32_t idx)
 {
-        int res;
-        pthread_mutex_lock(&rw_mtx);
-        res = lseek(inodes_fd, idx * sizeof(Inode), SEEK_SET);
-        if (res == -1) {
-                pthread_mutex_unlock(&rw_mtx);
+        if (!table || idx >= max_file_amount)
                 return false;
+        pthread_mutex_t *lock = &rw_mtx[idx % locks_amount];
+        pthread_mutex_lock(lock);
+        memcpy(&table[idx], ptr, sizeof(Inode));
+        journal.Log(Journal::inode_table, (off_t)idx * sizeof(Inode),
+                    &table[idx], sizeof(Inode));
+        pthread_mutex_unlock(lock);
+        MarkDirty(idx);
+        return true;
+}
+
+void InodeManager::Sync()
+{
+        if (!table)
+                return;
+        size_t pages = (table_size + page_size - 1) / page_size;
+        size_t first = 0, count = 0;
+        for (size_t i = 0; i <= pages; i++) {
+                bool dirty = false;
+                if (i < pages) {
+                        unsigned char bit = 1 << i % 8;
+                        dirty = __sync_fetch_and_and(&dirty_pages[i / 8],
+                                                     ~bit) & bit;
+                }
+                if (dirty) {
+                        if (count == 0)
+                                first = i;
+                        count++;
+                        continue;
+                }
+                if (count > 0) {
+                        size_t len = count * page_size;
+                        if (first * page_size + len > table_size)
+                                len = table_size - first * page_size;
+                        msync((char*)table + first * page_size, len, MS_SYNC);
+                        count = 0;
+                }
         }
-        res = write(inodes_fd, ptr, sizeof(Inode));
-        pthread_mutex_unlock(&rw_mtx);
-        return res == sizeof(Inode);
+        pthread_mutex_lock(&gf_mtx);
+        if (bitmap)
+                msync(bitmap, bitmap_words * sizeof(uint64_t), MS_SYNC);
+        pthread_mutex_unlock(&gf_mtx);
 }
 
-bool InodeManager::CreateInodeSpace(int dir)
+bool InodeManager::CreateInodeSpace(int dir, const Geometry &geometry)
 {
         int fd = openat(dir, "inode_space", O_RDWR | O_CREAT | O_TRUNC, 0644);
         if (fd == -1) {
                 perror("InodeManager::CreateInodeSpace(): open");
                 return false;
         }
-        int res = ftruncate(fd, max_file_amount * sizeof(struct Inode));
+        off_t size = (off_t)geometry.max_file_amount * sizeof(struct Inode);
+        int res = ftruncate(fd, size);
         if (res == -1) {
                 perror("InodeManager::CreateInodeSpace(): ftruncate");
                 return false;
         }
         close(fd);
+        return CreateFreeInodeArray(dir, geometry.max_file_amount);
+}
+
+bool InodeManager::CreateFreeInodeArray(int dir_fd, uint32_t file_amount)
+{
+        int fd = openat(dir_fd, "free_inodes",
+                        O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                perror("InodeManager::CreateFreeInodeArray(): open");
+                return false;
+        }
+        size_t words_amount = (file_amount + 63) / 64;
+        size_t size = words_amount * sizeof(uint64_t);
+        int res = ftruncate(fd, size);
+        if (res == -1) {
+                perror("InodeManager::CreateFreeInodeArray(): ftruncate");
+                close(fd);
+                return false;
+        }
+        void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+                perror("InodeManager::CreateFreeInodeArray(): mmap");
+                close(fd);
+                return false;
+        }
+        uint64_t *words = (uint64_t*)p;
+        memset(words, 0xFF, size);
+        if (file_amount % 64)
+                words[words_amount - 1] = ((uint64_t)1 << file_amount % 64) - 1;
+        words[0] &= ~(uint64_t)1;       /* the root */
+        msync(p, size, MS_SYNC);
+        munmap(p, size);
+        close(fd);
         return true;
 }
 
-void InodeManager::SearchFreeInodes()
+void InodeManager::MarkDirty(uint32_t idx)
 {
-        for (uint32_t idx = 1; idx < max_file_amount; idx++) {
-                Inode in;
-                ReadInode(&in, idx);
-                if (in.is_busy)
-                        continue;
-                cache_used--;
-                inodes_cache[cache_used] = idx;
-                if (cache_used == 0)
-                        break;
+        size_t first = idx * sizeof(Inode) / page_size;
+        size_t last = ((idx + 1) * sizeof(Inode) - 1) / page_size;
+        for (size_t i = first; i <= last; i++)
+                __sync_fetch_and_or(&dirty_pages[i / 8], 1 << i % 8);
+}
+
+void InodeManager::LogBitmap(uint32_t idx)
+{
+        journal.Log(Journal::inode_bitmap, idx / 64 * sizeof(uint64_t),
+                    &bitmap[idx / 64], sizeof(uint64_t));
+}
+
+bool InodeManager::OpenFreeInodeArray(int dir_fd)
+{
+        bool rebuild = false;
+        bitmap_fd = openat(dir_fd, "free_inodes", O_RDWR);
+        if (bitmap_fd == -1) {
+                /* image made before the bitmap existed, derive it once */
+                if (!CreateFreeInodeArray(dir_fd, max_file_amount))
+                        return false;
+                bitmap_fd = openat(dir_fd, "free_inodes", O_RDWR);
+                rebuild = true;
+        }
+        if (bitmap_fd == -1) {
+                perror("InodeManager::OpenFreeInodeArray(): open");
+                return false;
+        }
+        void *p = mmap(0, bitmap_words * sizeof(uint64_t),
+                       PROT_READ | PROT_WRITE, MAP_SHARED, bitmap_fd, 0);
+        if (p == MAP_FAILED) {
+                perror("InodeManager::OpenFreeInodeArray(): mmap");
+                return false;
         }
+        bitmap = (uint64_t*)p;
+        if (rebuild)
+                BuildFreeInodeArray();
+        return true;
 }
 
+void InodeManager::BuildFreeInodeArray()
+{
+        for (uint32_t idx = 1; idx < max_file_amount; idx++) {
+                if (table[idx].is_busy)
+                        bitmap[idx / 64] &= ~((uint64_t)1 << idx % 64);
+        }
+        msync(bitmap, bitmap_words * sizeof(uint64_t), MS_SYNC);
+}
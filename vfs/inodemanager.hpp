@@ -5,34 +5,58 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include "blockmanager.hpp"
+#include "freebitmap.hpp"
+#include "journal.hpp"
 
+enum InodeFlags {
+        inode_extents = 0x01,
+        inode_hashed_dir = 0x02
+};
+
+/* flags lives in what used to be padding, so images written before it
+ * existed read back with flags == 0 (the indirect block layout) */
 struct Inode {
         bool is_busy;
         bool is_dir;
+        uint8_t flags;
         off_t byte_size;
         off_t blk_size;
         BlockAddress block[10];
 };
 
 class InodeManager {
-        static const int max_file_amount = 1000000;
-        static const int inodes_cache_size = 16;
+        static const int locks_amount = 64;
+        static const size_t page_size = 4096;
+        uint32_t max_file_amount;
+        size_t bitmap_words;
         int inodes_fd;
-        int cache_used;
-        int inodes_cache[inodes_cache_size];
+        int bitmap_fd;
+        uint64_t *bitmap;
+        FreeBitmap free_map;
+        Inode *table;
+        size_t table_size;
+        unsigned char *dirty_pages;
+        size_t dirty_size;
         pthread_mutex_t gf_mtx;
-        pthread_mutex_t rw_mtx;
+        pthread_mutex_t rw_mtx[locks_amount];
+        Journal &journal;
 public:
-        InodeManager();
+        InodeManager(Journal &jrnl);
         ~InodeManager();
-        bool Init(int dir);
+        bool Init(int dir, const Geometry &geometry);
         uint32_t GetInode();
+        uint32_t GetInodes(uint32_t *idxs, uint32_t count);
         void FreeInode(uint32_t idx);
         bool ReadInode(Inode *ptr, uint32_t idx);
         bool WriteInode(const Inode *ptr, uint32_t idx);
-        static bool CreateInodeSpace(int dir_fd);
+        void Sync();
+        static bool CreateInodeSpace(int dir_fd, const Geometry &geometry);
+        static bool CreateFreeInodeArray(int dir_fd, uint32_t file_amount);
 private:
-        void SearchFreeInodes();
+        bool OpenFreeInodeArray(int dir_fd);
+        void BuildFreeInodeArray();
+        void MarkDirty(uint32_t idx);
+        void LogBitmap(uint32_t idx);
 };
 
 #endif /* INODEMANAGER_HPP_SENTRY */
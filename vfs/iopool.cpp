@@ -0,0 +1,150 @@
+#include <cstdio>
+#include "iopool.hpp"
+
+IOPool::IOPool() : workers_amount(0), head(0), tail(0), stopping(false)
+{
+        pthread_mutex_init(&mtx, 0);
+        pthread_cond_init(&work_cond, 0);
+        pthread_cond_init(&done_cond, 0);
+}
+
+IOPool::~IOPool()
+{
+        pthread_mutex_lock(&mtx);
+        stopping = true;
+        pthread_cond_broadcast(&work_cond);
+        pthread_mutex_unlock(&mtx);
+        for (int i = 0; i < workers_amount; i++)
+                pthread_join(workers[i], 0);
+        pthread_cond_destroy(&done_cond);
+        pthread_cond_destroy(&work_cond);
+        pthread_mutex_destroy(&mtx);
+}
+
+/* grows the pool to the given number of workers */
+bool IOPool::Start(int workers)
+{
+        bool retval = true;
+        if (workers > max_workers)
+                workers = max_workers;
+        pthread_mutex_lock(&mtx);
+        while (workers_amount < workers) {
+                int res = pthread_create(&this->workers[workers_amount], 0,
+                                         Worker, this);
+                if (res != 0) {
+                        fputs("IOPool::Start(): pthread_create failed\n",
+                              stderr);
+                        retval = false;
+                        break;
+                }
+                workers_amount++;
+        }
+        pthread_mutex_unlock(&mtx);
+        return retval;
+}
+
+void IOPool::Run(const IOTask *tasks, int count)
+{
+        if (count <= 0)
+                return;
+        Batch batch;
+        batch.pending = count;
+        Item *items = new Item[count];
+        pthread_mutex_lock(&mtx);
+        for (int i = 0; i < count; i++) {
+                items[i].task = tasks[i];
+                items[i].batch = &batch;
+                Push(&items[i]);
+        }
+        pthread_cond_broadcast(&work_cond);
+        while (batch.pending > 0) {
+                Item *item = Pop();
+                if (item) {
+                        pthread_mutex_unlock(&mtx);
+                        RunItem(item);
+                        pthread_mutex_lock(&mtx);
+                } else {
+                        pthread_cond_wait(&done_cond, &mtx);
+                }
+        }
+        pthread_mutex_unlock(&mtx);
+        delete[] items;
+}
+
+/* queues the tasks and returns at once; with no workers started they
+ * run right here */
+void IOPool::Post(const IOTask *tasks, int count)
+{
+        pthread_mutex_lock(&mtx);
+        bool inline_run = workers_amount == 0;
+        if (!inline_run) {
+                for (int i = 0; i < count; i++) {
+                        Item *item = new Item;
+                        item->task = tasks[i];
+                        item->batch = 0;
+                        Push(item);
+                }
+                pthread_cond_broadcast(&work_cond);
+        }
+        pthread_mutex_unlock(&mtx);
+        for (int i = 0; inline_run && i < count; i++)
+                tasks[i].run(tasks[i].arg);
+}
+
+/* runs the task and reports it done to its batch, posted items have
+ * none and are freed */
+void IOPool::RunItem(Item *item)
+{
+        item->task.run(item->task.arg);
+        if (!item->batch) {
+                delete item;
+                return;
+        }
+        pthread_mutex_lock(&mtx);
+        if (--item->batch->pending == 0)
+                pthread_cond_broadcast(&done_cond);
+        pthread_mutex_unlock(&mtx);
+}
+
+/* called under mtx */
+void IOPool::Push(Item *item)
+{
+        item->next = 0;
+        if (tail)
+                tail->next = item;
+        else
+                head = item;
+        tail = item;
+}
+
+/* called under mtx */
+IOPool::Item *IOPool::Pop()
+{
+        Item *item = head;
+        if (item) {
+                head = item->next;
+                if (!head)
+                        tail = 0;
+        }
+        return item;
+}
+
+void *IOPool::Worker(void *arg)
+{
+        IOPool *pool = (IOPool*)arg;
+        pthread_mutex_lock(&pool->mtx);
+        for (;;) {
+                Item *item = pool->Pop();
+                if (item) {
+                        pthread_mutex_unlock(&pool->mtx);
+                        pool->RunItem(item);
+                        pthread_mutex_lock(&pool->mtx);
+                } else if (pool->stopping) {
+                        break;
+                } else {
+                        pthread_cond_wait(&pool->work_cond, &pool->mtx);
+                }
+        }
+        pthread_mutex_unlock(&pool->mtx);
+        return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef IOPOOL_HPP_SENTRY
+#define IOPOOL_HPP_SENTRY
+
+#include <pthread.h>
+
+struct IOTask {
+        void (*run)(void *arg);
+        void *arg;
+};
+
+/* Small pool of worker threads for splitting one transfer into parts
+ * that run at once.  Run() hands the tasks to the workers, works on the
+ * queue itself too and returns once all of its tasks are done, so it
+ * also works (serially) with no workers started.  Post() only queues
+ * the tasks, which report their own completion. */
+class IOPool {
+        static const int max_workers = 16;
+        struct Batch {
+                int pending;
+        };
+        struct Item {
+                IOTask task;
+                Batch *batch;
+                Item *next;
+        };
+        pthread_mutex_t mtx;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+        pthread_t workers[max_workers];
+        int workers_amount;
+        Item *head;
+        Item *tail;
+        bool stopping;
+public:
+        IOPool();
+        ~IOPool();
+        bool Start(int workers);
+        int Workers() const { return workers_amount; }
+        void Run(const IOTask *tasks, int count);
+        void Post(const IOTask *tasks, int count);
+private:
+        void RunItem(Item *item);
+        void Push(Item *item);
+        Item *Pop();
+        static void *Worker(void *arg);
+        IOPool(const IOPool&);
+        void operator=(const IOPool&);
+};
+
+#endif /* IOPOOL_HPP_SENTRY */
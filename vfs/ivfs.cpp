@@ -6,97 +6,112 @@
 #include <unistd.h>
 #include "ivfs.hpp"
 
-IVFS::IVFS() : dir_fd(-1), first(0)
+IVFS::IVFS() : dir_fd(-1), im(journal), bm(journal), dm(im, bm), files(im)
 {
-        pthread_mutex_init(&mtx, 0);
+        memset(&ra_stats, 0, sizeof(ra_stats));
+        pthread_rwlock_init(&ns_lock, 0);
+        for (int i = 0; i < dir_locks_amount; i++)
+                pthread_rwlock_init(&dir_locks[i], 0);
 }
 
 IVFS::~IVFS()
 {
-        pthread_mutex_destroy(&mtx);
+        pthread_rwlock_destroy(&ns_lock);
+        for (int i = 0; i < dir_locks_amount; i++)
+                pthread_rwlock_destroy(&dir_locks[i]);
         if (dir_fd != -1)
                 close(dir_fd);
-        OpenedFileItem *tmp;
-        while (first) {
-                tmp = first;
-                first = first->next;
-                im.WriteInode(&tmp->file->in, tmp->file->inode_idx);
-                delete tmp->file;
-                delete tmp;
-        }
 }
 
-bool IVFS::Boot(const char *path, bool makefs)
+bool IVFS::Boot(const char *path, bool makefs, size_t cache_size)
 {
-        int res;
-        dir_fd = open(path, O_RDONLY | O_DIRECTORY);
-        if (dir_fd == -1) {
-                perror("open");
-                return false;
-        }
-        if (makefs)
-                CreateFileSystem(dir_fd);
-        res = im.Init(dir_fd);
-        if (!res) {
-                fputs("Failed to start InodeManager\n", stderr);
-                return false;
-        }
-        res = bm.Init(dir_fd);
-        if (!res) {
-                fputs("Failed to start BlockManager\n", stderr);
-                return false;
-        }
-        if (makefs)
-                CreateRootDirectory();
-        fputs("Virtual File System started successfully\n", stderr);
-        return true;
+        Geometry defaults = Superblock::Default();
+        return Mount(path, makefs ? &defaults : 0, cache_size);
+}
+
+/* makes a new file system with the given geometry and boots it */
+bool IVFS::Boot(const char *path, const Geometry &geometry, size_t cache_size)
+{
+        return Mount(path, &geometry, cache_size);
 }
 
 bool IVFS::Create(const char *path, bool is_dir)
 {
-        pthread_mutex_lock(&mtx);
+        pthread_rwlock_rdlock(&ns_lock);
         SearchInode(path, true, is_dir);
-        pthread_mutex_unlock(&mtx);
+        pthread_rwlock_unlock(&ns_lock);
+        CommitMetadata();
         return true;
 } 
 
 bool IVFS::Remove(const char *path, bool recursive)
 {
-        char dirname[max_name_len];
-        char filename[max_name_len];
-        if (!CheckPath(path)) {
-                fprintf(stderr, "Invalid path: %s\n", path);
-                return false;
-        }
-        GetDirectory(path, dirname, filename);
-        pthread_mutex_lock(&mtx);
-        int dir_idx = SearchInode(dirname, false);
-        if (dir_idx == -1) {
-                fprintf(stderr, "Directory %s not found\n", dirname);
-                pthread_mutex_unlock(&mtx);
-                return false;
-        }
-        int idx = SearchFileInDir(dir_idx, filename);
-        if (idx == -1) {
-                fprintf(stderr, "File %s not found\n", filename);
-                pthread_mutex_unlock(&mtx);
-                return false;
+        return RemoveBatch(&path, 1, recursive) == 1;
+}
+
+/* creates the files (or directories) that do not exist yet, handling the
+ * paths of one directory together; returns how many it created */
+int IVFS::CreateBatch(const char * const *paths, int count, bool is_dir)
+{
+        BatchEntry *entries = SplitPaths(paths, count);
+        int created = 0;
+        pthread_rwlock_rdlock(&ns_lock);
+        for (int i = 0, j; i < count; i = j) {
+                for (j = i + 1; j < count; j++) {
+                        if (strcmp(entries[i].dirname, entries[j].dirname))
+                                break;
+                }
+                created += CreateGroup(entries + i, j - i, is_dir);
         }
-        if (!recursive && IsDirectory(idx)) {
-                fprintf(stderr, "%s is dir, use recursive = true\n", path);
-                pthread_mutex_unlock(&mtx);
-                return false;
+        pthread_rwlock_unlock(&ns_lock);
+        FreeEntries(entries, count);
+        CommitMetadata();
+        return created;
+}
+
+/* removes the files, directories only when recursive; returns how many
+ * paths it removed */
+int IVFS::RemoveBatch(const char * const *paths, int count, bool recursive)
+{
+        BatchEntry *entries = SplitPaths(paths, count);
+        int removed = 0;
+        bool exclusive = false;
+        /* directories are left pending by the first pass, which holds
+         * ns_lock shared, and removed by a second one holding it
+         * exclusive */
+        for (int pass = 0; pass < 2; pass++) {
+                if (exclusive)
+                        pthread_rwlock_wrlock(&ns_lock);
+                else
+                        pthread_rwlock_rdlock(&ns_lock);
+                bool pending = false;
+                for (int i = 0, j; i < count; i = j) {
+                        bool todo = false;
+                        for (j = i; j < count; j++) {
+                                if (strcmp(entries[i].dirname,
+                                           entries[j].dirname))
+                                        break;
+                                todo = todo || entries[j].pending;
+                        }
+                        if (!todo)
+                                continue;
+                        removed += RemoveGroup(entries + i, j - i,
+                                               recursive, exclusive);
+                        for (int k = i; k < j; k++)
+                                pending = pending || entries[k].pending;
+                }
+                pthread_rwlock_unlock(&ns_lock);
+                if (!pending)
+                        break;
+                exclusive = true;
         }
-        RecursiveDeletion(idx);
-        DeleteDirRecord(dir_idx, filename);
-        pthread_mutex_unlock(&mtx);
-        return true;
+        FreeEntries(entries, count);
+        CommitMetadata();
+        return removed;
 }
 
 bool IVFS::Rename(const char *oldpath, const char *newpath)
 {
-        char old_dirname[max_name_len], old_filename[max_name_len];
-        char new_dirname[max_name_len], new_filename[max_name_len];
         if (!CheckPath(oldpath)) {
                 fprintf(stderr, "Invalid path: %s\n", oldpath);
                 return false;
@@ -105,36 +120,73 @@ bool IVFS::Rename(const char *oldpath, const char *newpath)
                 fprintf(stderr, "Invalid path: %s\n", newpath);
                 return false;
         }
+        char *old_dirname = new char[strlen(oldpath) + 1];
+        char *new_dirname = new char[strlen(newpath) + 1];
+        char old_filename[max_name_len + 1], new_filename[max_name_len + 1];
         GetDirectory(oldpath, old_dirname, old_filename);
         GetDirectory(newpath, new_dirname, new_filename);
-        pthread_mutex_lock(&mtx);
-        int old_dir_idx = SearchInode(old_dirname, false);
-        if (old_dir_idx == -1) {
-                fprintf(stderr, "Directory %s not found\n", old_dirname);
-                pthread_mutex_unlock(&mtx);
-                return false;
+        pthread_rwlock_rdlock(&ns_lock);
+        OpResult res = RenameEntry(old_dirname, old_filename,
+                                   new_dirname, new_filename, false);
+        pthread_rwlock_unlock(&ns_lock);
+        if (res == op_exclusive) {
+                pthread_rwlock_wrlock(&ns_lock);
+                res = RenameEntry(old_dirname, old_filename,
+                                  new_dirname, new_filename, true);
+                pthread_rwlock_unlock(&ns_lock);
         }
-        int idx = SearchFileInDir(old_dir_idx, old_filename);
-        if (idx == -1) {
-                fprintf(stderr, "File %s not found\n", old_filename);
-                pthread_mutex_unlock(&mtx);
-                return false;
+        delete[] old_dirname;
+        delete[] new_dirname;
+        CommitMetadata();
+        return res == op_done;
+}
+
+/* lists the directory ("/" for the root); returns the number of names,
+ * -1 when the path is not a directory */
+int IVFS::List(const char *path, DirListing **listing)
+{
+        *listing = 0;
+        bool root = !strcmp(path, "/");
+        if (!root && !CheckPath(path)) {
+                fprintf(stderr, "Invalid path: %s\n", path);
+                return -1;
         }
-        int new_dir_idx = SearchInode(new_dirname, true, true);
-        if (!IsDirectory(new_dir_idx)) {
-                fprintf(stderr, "Path %s not directory\n", new_dirname);
-                pthread_mutex_unlock(&mtx);
-                return false;
+        int count = -1;
+        pthread_rwlock_rdlock(&ns_lock);
+        int idx = root ? 0 : SearchInode(path, false);
+        if (idx != -1) {
+                LockDir(idx, false);
+                Inode in;
+                im.ReadInode(&in, idx);
+                if (in.is_dir) {
+                        DirRecordList *ls = dm.List(&in);
+                        count = 0;
+                        for (DirRecordList *tmp = ls; tmp; tmp = tmp->next) {
+                                Inode child;
+                                im.ReadInode(&child, tmp->inode_idx);
+                                DirListing *d = new DirListing;
+                                strcpy(d->name, tmp->filename);
+                                d->is_dir = child.is_dir;
+                                d->size = child.is_dir ? 0 : child.byte_size;
+                                d->next = *listing;
+                                *listing = d;
+                                count++;
+                        }
+                        DirManager::FreeList(ls);
+                }
+                UnlockDir(idx);
         }
-        if (SearchFileInDir(new_dir_idx, new_filename) != -1) {
-                fprintf(stderr, "Path %s already exists\n", newpath);
-                pthread_mutex_unlock(&mtx);
-                return false;
+        pthread_rwlock_unlock(&ns_lock);
+        return count;
+}
+
+void IVFS::FreeListing(DirListing *listing)
+{
+        while (listing) {
+                DirListing *tmp = listing;
+                listing = listing->next;
+                delete tmp;
         }
-        DeleteDirRecord(old_dir_idx, old_filename);
-        CreateDirRecord(new_dir_idx, new_filename, idx);
-        pthread_mutex_unlock(&mtx);
-        return true;
 }
 
 File *IVFS::Open(const char *path, const char *flags)
@@ -146,33 +198,62 @@ File *IVFS::Open(const char *path, const char *flags)
                 fprintf(stderr, "Invalid path: %s\n", path);
                 return 0;
         }
-        pthread_mutex_lock(&mtx);
-        int idx = SearchInode(path, opf.c_flag);
+        char *dirname = new char[strlen(path) + 1];
+        char filename[max_name_len + 1];
+        GetDirectory(path, dirname, filename);
+        OpenedFile *ofptr = 0;
+        bool is_dir = false;
+        int idx = -1;
+        pthread_rwlock_rdlock(&ns_lock);
+        int dir_idx = SearchInode(dirname, opf.c_flag, true);
+        if (dir_idx != -1) {
+                idx = LockedLookup(dir_idx, filename, opf.c_flag, false);
+                if (idx != -1)
+                        is_dir = IsDirectory(idx);
+                if (idx != -1 && !is_dir)
+                        ofptr = files.Open(idx, opf.r_flag, opf.w_flag);
+                UnlockDir(dir_idx);
+        }
+        pthread_rwlock_unlock(&ns_lock);
+        delete[] dirname;
+        if (opf.c_flag)
+                CommitMetadata();
         if (idx == -1) {
                 fputs("File's inode not found\n", stderr);
-                pthread_mutex_unlock(&mtx);
                 return 0;
         }
-        if (IsDirectory(idx)) {
+        if (is_dir) {
                 fputs("Open directory is not permitted\n", stderr);
-                pthread_mutex_unlock(&mtx);
                 return 0;
         }
-        OpenedFile *ofptr = OpenFile(idx, opf.r_flag, opf.w_flag);
-        pthread_mutex_unlock(&mtx);
         if (!ofptr) {
                 fputs("Incompatible file open mode\n", stderr); 
                 return 0;
         }
+        pthread_mutex_lock(&ofptr->mtx);
         if (opf.w_flag && opf.t_flag && ofptr->in.byte_size > 0) {
                 bm.FreeBlocks(&ofptr->in);
                 bm.AddBlock(&ofptr->in);
         }
+        if (opf.w_flag)
+                bm.ConvertToExtents(&ofptr->in);
         File *fp = new File;
         fp->cur_pos = 0;
         fp->cur_block = 0;
-        fp->block = (char*)bm.ReadBlock(ofptr->in.block[0]);
+        fp->block = (char*)bm.PinBlock(bm.GetBlock(&ofptr->in, 0));
         fp->master = ofptr;
+        fp->map_first = 0;
+        fp->map_len = 0;
+        fp->map_block = 0;
+        fp->map_block_first = 0;
+        fp->map_block_count = 0;
+        fp->ra_next = 0;
+        fp->ra_begin = 0;
+        fp->ra_end = 0;
+        fp->ra_window = 0;
+        pthread_mutex_unlock(&ofptr->mtx);
+        if (opf.w_flag && opf.t_flag)
+                CommitMetadata();
         return fp;
 }
 
@@ -180,19 +261,20 @@ void IVFS::Close(File *fp)
 {
         if (!fp)
                 return;
-        bm.UnmapBlock(fp->block);
-        pthread_mutex_lock(&mtx);
-        fp->master->opened--;
-        if (fp->master->opened == 0) {
-                if (fp->master->defer_delete) {
-                        bm.FreeBlocks(&fp->master->in);
-                } else {
-                        im.WriteInode(&fp->master->in, fp->master->inode_idx);
-                }
-                DeleteOpenedFile(fp->master);
+        bool wrote = fp->master->perm_write;
+        bm.UnpinBlock(fp->block, wrote);
+        bm.UnpinBlock(fp->map_block);
+        if (files.Release(fp->master)) {
+                bm.FreeBlocks(&fp->master->in);
+                files.Recycle(fp->master);
         }
-        pthread_mutex_unlock(&mtx);
         delete fp;
+        /* the writes' block allocations and the new size are committed
+         * here rather than with every write */
+        if (wrote)
+                CommitMetadata();
+        else if (journal.Full())
+                Sync();
 }
 
 ssize_t IVFS::Read(File *fp, char *buf, size_t len)
@@ -201,8 +283,13 @@ ssize_t IVFS::Read(File *fp, char *buf, size_t len)
                 fputs("File opened in write-only mode", stderr);
                 return -1;
         }
+        if (len >= (size_t)bm.BlockSize()) {
+                struct iovec iov = { buf, len };
+                return ReadV(fp, &iov, 1);
+        }
         size_t rc = 0;
-        size_t was_read = fp->cur_block * bm.BlockSize() + fp->cur_pos;
+        off_t pos = Tell(fp);
+        size_t was_read = pos;
         if (len > fp->master->in.byte_size - was_read)
                 len = fp->master->in.byte_size - was_read;
         while (len > 0) {
@@ -215,15 +302,11 @@ ssize_t IVFS::Read(File *fp, char *buf, size_t len)
                 } else {
                         memcpy(buf + rc, fp->block + fp->cur_pos, can_read);
                         rc += can_read;
-                        fp->cur_pos = 0;
-                        fp->cur_block++;
-                        BlockAddress next = bm.GetBlock(&fp->master->in,
-                                                     fp->cur_block);
-                        bm.UnmapBlock(fp->block);
-                        fp->block = (char*)bm.ReadBlock(next);
                         len -= can_read;
+                        MoveCursor(fp, pos + rc);
                 }
         }
+        Readahead(fp, pos, rc);
         return rc;
 }
 
@@ -233,35 +316,195 @@ ssize_t IVFS::Write(File *fp, const char *buf, size_t len)
                 fputs("File opened in read-only mode", stderr);
                 return 0;
         }
+        if (len >= (size_t)bm.BlockSize()) {
+                struct iovec iov = { (void*)buf, len };
+                return WriteV(fp, &iov, 1);
+        }
         size_t wc = 0;
+        Inode *in = &fp->master->in;
+        pthread_mutex_lock(&fp->master->mtx);
         while (len > 0) {
                 size_t can_write = bm.BlockSize() - fp->cur_pos;
                 if (len < can_write) {
                         memcpy(fp->block + fp->cur_pos, buf + wc, len);
                         fp->cur_pos += len;
-                        fp->master->in.byte_size += len;
                         wc += len;
                         len = 0;
                 } else {
                         memcpy(fp->block + fp->cur_pos, buf + wc, can_write);
-                        fp->master->in.byte_size += can_write;
                         wc += can_write;
                         fp->cur_pos = 0;
                         fp->cur_block++;
-                        BlockAddress next = bm.AddBlock(&fp->master->in);
-                        bm.UnmapBlock(fp->block);
-                        fp->block = (char*)bm.ReadBlock(next);
+                        BlockAddress next = MapBlock(fp, fp->cur_block);
+                        bm.UnpinBlock(fp->block, true);
+                        fp->block = (char*)bm.PinBlock(next);
                         len -= can_write;
                 }
         }
+        off_t end = fp->cur_block * bm.BlockSize() + fp->cur_pos;
+        if (end > in->byte_size)
+                in->byte_size = end;
+        pthread_mutex_unlock(&fp->master->mtx);
+        if (journal.Full())
+                Sync();
         return wc;
 }
 
+ssize_t IVFS::PRead(File *fp, char *buf, size_t len, off_t offset)
+{
+        struct iovec iov = { buf, len };
+        return PReadV(fp, &iov, 1, offset);
+}
+
+ssize_t IVFS::PWrite(File *fp, const char *buf, size_t len, off_t offset)
+{
+        struct iovec iov = { (void*)buf, len };
+        return PWriteV(fp, &iov, 1, offset);
+}
+
+ssize_t IVFS::ReadV(File *fp, const struct iovec *iov, int iovcnt)
+{
+        off_t pos = Tell(fp);
+        ssize_t rc = PReadV(fp, iov, iovcnt, pos);
+        if (rc > 0) {
+                MoveCursor(fp, pos + rc);
+                Readahead(fp, pos, rc);
+        }
+        return rc;
+}
+
+ssize_t IVFS::WriteV(File *fp, const struct iovec *iov, int iovcnt)
+{
+        off_t pos = Tell(fp);
+        ssize_t wc = PWriteV(fp, iov, iovcnt, pos);
+        if (wc > 0)
+                MoveCursor(fp, pos + wc);
+        return wc;
+}
+
+/* Positional I/O leaves the cursor alone.  A handle opened for writing
+ * may be shared with PWrite extending the block map, so reads through it
+ * take the file lock; read-only handles have no writer to race with. */
+ssize_t IVFS::PReadV(File *fp, const struct iovec *iov, int iovcnt,
+                     off_t offset)
+{
+        OpenedFile *ofptr = fp->master;
+        if (!ofptr->perm_read) {
+                fputs("File opened in write-only mode", stderr);
+                return -1;
+        }
+        if (offset < 0 || iovcnt < 0)
+                return -1;
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++)
+                len += iov[i].iov_len;
+        bool locked = ofptr->perm_write;
+        if (locked)
+                pthread_mutex_lock(&ofptr->mtx);
+        if (offset >= ofptr->in.byte_size)
+                len = 0;
+        else if (len > (size_t)(ofptr->in.byte_size - offset))
+                len = ofptr->in.byte_size - offset;
+        size_t rc = CopyV(&ofptr->in, iov, iovcnt, offset, len, false);
+        if (locked)
+                pthread_mutex_unlock(&ofptr->mtx);
+        return rc;
+}
+
+ssize_t IVFS::PWriteV(File *fp, const struct iovec *iov, int iovcnt,
+                      off_t offset)
+{
+        OpenedFile *ofptr = fp->master;
+        if (!ofptr->perm_write) {
+                fputs("File opened in read-only mode", stderr);
+                return 0;
+        }
+        if (offset < 0 || iovcnt < 0)
+                return -1;
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++)
+                len += iov[i].iov_len;
+        pthread_mutex_lock(&ofptr->mtx);
+        Inode *in = &ofptr->in;
+        off_t bs = bm.BlockSize();
+        off_t need = (offset + (off_t)len + bs - 1) / bs - in->blk_size;
+        if (need > 1)
+                bm.AddBlocks(in, need);
+        if (offset > in->byte_size && !ZeroRange(in, in->byte_size, offset))
+                len = 0;
+        size_t wc = CopyV(in, iov, iovcnt, offset, len, true);
+        if (offset + (off_t)wc > in->byte_size)
+                in->byte_size = offset + wc;
+        pthread_mutex_unlock(&ofptr->mtx);
+        /* a file kept open and written on must not grow the journal
+         * until it is closed */
+        if (journal.Full())
+                Sync();
+        return wc;
+}
+
+/* Fills views with the file data of [offset, offset + len) without
+ * copying it; blocks lying next to each other in a storage share one
+ * view.  The blocks stay pinned until ReleaseViews(), which must come
+ * before the file is closed.  Returns the number of views, fewer bytes
+ * than asked for when max_views ran out or the file ended. */
+int IVFS::MapRange(File *fp, off_t offset, size_t len,
+                   FileView *views, int max_views)
+{
+        OpenedFile *ofptr = fp->master;
+        if (!ofptr->perm_read) {
+                fputs("File opened in write-only mode", stderr);
+                return -1;
+        }
+        if (offset < 0 || max_views < 0)
+                return -1;
+        bool locked = ofptr->perm_write;
+        if (locked)
+                pthread_mutex_lock(&ofptr->mtx);
+        if (offset >= ofptr->in.byte_size)
+                len = 0;
+        else if (len > (size_t)(ofptr->in.byte_size - offset))
+                len = ofptr->in.byte_size - offset;
+        int count = 0;
+        size_t done = 0, bs = bm.BlockSize();
+        while (done < len) {
+                off_t pos = offset + done;
+                size_t in_block = pos % bs;
+                size_t n = bs - in_block < len - done ? bs - in_block
+                                                      : len - done;
+                BlockAddress addr = bm.GetBlock(&ofptr->in, pos / bs);
+                char *block = (char*)bm.PinBlock(addr);
+                if (!block)
+                        break;
+                const char *p = block + in_block;
+                FileView *last = count > 0 ? &views[count - 1] : 0;
+                if (last && last->data + last->len == p) {
+                        last->len += n;
+                } else if (count < max_views) {
+                        views[count].data = p;
+                        views[count].len = n;
+                        count++;
+                } else {
+                        bm.UnpinBlock(block);
+                        break;
+                }
+                done += n;
+        }
+        if (locked)
+                pthread_mutex_unlock(&ofptr->mtx);
+        return count;
+}
+
+void IVFS::ReleaseViews(const FileView *views, int count)
+{
+        for (int i = 0; i < count; i++)
+                bm.UnpinRange(views[i].data, views[i].len);
+}
+
 off_t IVFS::Lseek(File *fp, off_t offset, int whence)
 {
-        off_t new_pos, pos = fp->cur_block * bm.BlockSize() + fp->cur_pos;
-        off_t end_pos = fp->master->in.blk_size - 1;
-        off_t old_block = fp->cur_block;
+        off_t new_pos, pos = Tell(fp);
+        off_t end_pos = fp->master->in.byte_size;
         switch (whence) {
         case 0:
                 new_pos = offset;
@@ -279,106 +522,576 @@ off_t IVFS::Lseek(File *fp, off_t offset, int whence)
                 new_pos = end_pos;
         if (new_pos < 0)
                 new_pos = 0;
-        fp->cur_block = new_pos / bm.BlockSize();
-        fp->cur_pos = new_pos % bm.BlockSize();
-        if (fp->cur_block != old_block) {
-                bm.UnmapBlock(fp->block);
-                BlockAddress addr = bm.GetBlock(&fp->master->in, fp->cur_block);
-                fp->block = (char*)bm.ReadBlock(addr);
-        }
+        MoveCursor(fp, new_pos);
         return new_pos;
 }
 
-void IVFS::RecursiveDeletion(int idx)
+void IVFS::Sync()
 {
-        Inode in;
-        im.ReadInode(&in, idx);
-        if (in.is_dir) {
-                DirRecordList *ls = ReadDirectory(&in);
-                for (DirRecordList *tmp = ls; tmp; tmp = tmp->next)
-                        RecursiveDeletion(tmp->inode_idx);
-                FreeDirRecordList(ls);
+        files.WriteBack();
+        uint64_t mark = journal.Mark();
+        im.Sync();
+        bm.Sync();
+        journal.Checkpoint(mark);
+}
+
+/* makes the changes logged so far durable, sharing the fsync with the
+ * threads committing at the same time */
+void IVFS::CommitMetadata()
+{
+        journal.Commit();
+        if (journal.Full())
+                Sync();
+}
+
+bool IVFS::ConvertDirectories()
+{
+        pthread_rwlock_wrlock(&ns_lock);
+        bool res = ConvertTree(0);
+        pthread_rwlock_unlock(&ns_lock);
+        if (res)
+                Sync();
+        return res;
+}
+
+/* splits the valid paths into directory and name, sorted by directory
+ * and then name; count becomes the number of valid ones */
+IVFS::BatchEntry *IVFS::SplitPaths(const char * const *paths, int &count)
+{
+        BatchEntry *entries = new BatchEntry[count > 0 ? count : 1];
+        int valid = 0;
+        for (int i = 0; i < count; i++) {
+                if (!CheckPath(paths[i])) {
+                        fprintf(stderr, "Invalid path: %s\n", paths[i]);
+                        continue;
+                }
+                BatchEntry &e = entries[valid++];
+                e.dirname = new char[strlen(paths[i]) + 1];
+                GetDirectory(paths[i], e.dirname, e.filename);
+                e.pending = true;
         }
-        OpenedFile *ofptr = SearchOpenedFile(idx);
-        if (ofptr) {
-                ofptr->defer_delete = true;
-        } else {
-                bm.FreeBlocks(&in);
+        count = valid;
+        qsort(entries, count, sizeof(*entries), CompareEntries);
+        return entries;
+}
+
+void IVFS::FreeEntries(BatchEntry *entries, int count)
+{
+        for (int i = 0; i < count; i++)
+                delete[] entries[i].dirname;
+        delete[] entries;
+}
+
+int IVFS::CompareEntries(const void *a, const void *b)
+{
+        const BatchEntry *x = (const BatchEntry*)a;
+        const BatchEntry *y = (const BatchEntry*)b;
+        int res = strcmp(x->dirname, y->dirname);
+        return res ? res : strcmp(x->filename, y->filename);
+}
+
+/* entries share one directory, resolved and locked once for all */
+int IVFS::CreateGroup(BatchEntry *entries, int count, bool is_dir)
+{
+        int dir_idx = SearchInode(entries[0].dirname, true, true);
+        if (dir_idx == -1)
+                return 0;
+        const char **names = new const char*[count];
+        int missing = 0;
+        LockDir(dir_idx, true);
+        for (int i = 0; i < count; i++) {
+                const char *name = entries[i].filename;
+                if (missing > 0 && !strcmp(names[missing - 1], name))
+                        continue;
+                if (SearchFileInDir(dir_idx, name) == -1)
+                        names[missing++] = name;
         }
-        im.FreeInode(idx);
+        int created = 0;
+        if (missing > 0)
+                created = CreateEntries(dir_idx, names, missing, is_dir);
+        UnlockDir(dir_idx);
+        delete[] names;
+        return created;
 }
 
-OpenedFile *IVFS::OpenFile(int idx, bool want_read, bool want_write)
+/* makes the inodes, first blocks and directory records of count new
+ * names in bulk; called with the directory locked exclusive */
+int IVFS::CreateEntries(int dir_idx, const char **names, int count,
+                        bool is_dir)
 {
-        OpenedFile *ofptr = SearchOpenedFile(idx);
-        if (ofptr) {
-                if (!ofptr->perm_write && !want_write) {
-                        ofptr->opened++;
-                        return ofptr;
-                }
+        Inode *ins = new Inode[count];
+        Inode **ptrs = new Inode*[count];
+        uint32_t *inodes = new uint32_t[count];
+        int *idxs = new int[count];
+        for (int i = 0; i < count; i++) {
+                memset(&ins[i], 0, sizeof(Inode));
+                ins[i].is_busy = true;
+                ins[i].is_dir = is_dir;
+                ptrs[i] = &ins[i];
+                if (is_dir)
+                        dm.InitDirectory(&ins[i]);
+        }
+        if (!is_dir)
+                bm.AddFirstBlocks(ptrs, count);
+        int got = im.GetInodes(inodes, count);
+        for (int i = 0; i < got; i++) {
+                idxs[i] = inodes[i];
+                im.WriteInode(&ins[i], inodes[i]);
+        }
+        int inserted = dm.InsertBatch(dir_idx, names, idxs, got);
+        for (int i = 0; i < inserted; i++)
+                dcache.Insert(dir_idx, names[i], idxs[i]);
+        for (int i = inserted; i < count; i++) {
+                fprintf(stderr, "Failed to create %s\n", names[i]);
+                bm.FreeBlocks(&ins[i]);
+                if (i < got)
+                        im.FreeInode(inodes[i]);
+        }
+        delete[] ins;
+        delete[] ptrs;
+        delete[] inodes;
+        delete[] idxs;
+        return inserted;
+}
+
+/* removes the pending entries of one directory; without exclusive the
+ * directories among them are left pending */
+int IVFS::RemoveGroup(BatchEntry *entries, int count, bool recursive,
+                      bool exclusive)
+{
+        int dir_idx = SearchInode(entries[0].dirname, false);
+        if (dir_idx == -1) {
+                fprintf(stderr, "Directory %s not found\n",
+                        entries[0].dirname);
+                for (int i = 0; i < count; i++)
+                        entries[i].pending = false;
                 return 0;
         }
-        ofptr = AddOpenedFile(idx, want_read, want_write);
-        return ofptr;
+        int removed = 0;
+        LockDir(dir_idx, true);
+        for (int i = 0; i < count; i++) {
+                BatchEntry &e = entries[i];
+                if (!e.pending)
+                        continue;
+                int idx = SearchFileInDir(dir_idx, e.filename);
+                bool is_dir = idx != -1 && IsDirectory(idx);
+                if (is_dir && recursive && !exclusive)
+                        continue;
+                e.pending = false;
+                if (idx == -1) {
+                        fprintf(stderr, "File %s not found\n", e.filename);
+                        continue;
+                }
+                if (is_dir && !recursive) {
+                        fprintf(stderr, "%s/%s is dir, use recursive = true\n",
+                                e.dirname, e.filename);
+                        continue;
+                }
+                RecursiveDeletion(idx);
+                DeleteDirRecord(dir_idx, e.filename);
+                if (is_dir)
+                        dcache.Clear();
+                removed++;
+        }
+        UnlockDir(dir_idx);
+        return removed;
+}
+
+IVFS::OpResult IVFS::RenameEntry(const char *old_dirname,
+                                 const char *old_filename,
+                                 const char *new_dirname,
+                                 const char *new_filename, bool exclusive)
+{
+        int old_dir_idx = SearchInode(old_dirname, false);
+        if (old_dir_idx == -1) {
+                fprintf(stderr, "Directory %s not found\n", old_dirname);
+                return op_failed;
+        }
+        int idx = LockedLookup(old_dir_idx, old_filename, false, false);
+        UnlockDir(old_dir_idx);
+        if (idx == -1) {
+                fprintf(stderr, "File %s not found\n", old_filename);
+                return op_failed;
+        }
+        int new_dir_idx = SearchInode(new_dirname, true, true);
+        if (new_dir_idx == -1 || !IsDirectory(new_dir_idx)) {
+                fprintf(stderr, "Path %s not directory\n", new_dirname);
+                return op_failed;
+        }
+        OpResult res = op_done;
+        LockDirs(old_dir_idx, new_dir_idx);
+        idx = SearchFileInDir(old_dir_idx, old_filename);
+        if (idx == -1) {
+                fprintf(stderr, "File %s not found\n", old_filename);
+                res = op_failed;
+        } else if (SearchFileInDir(new_dir_idx, new_filename) != -1) {
+                fprintf(stderr, "Path %s/%s already exists\n",
+                        new_dirname, new_filename);
+                res = op_failed;
+        } else if (old_dir_idx != new_dir_idx && !exclusive &&
+                   IsDirectory(idx)) {
+                res = op_exclusive;
+        } else {
+                DeleteDirRecord(old_dir_idx, old_filename);
+                CreateDirRecord(new_dir_idx, new_filename, idx);
+        }
+        UnlockDirs(old_dir_idx, new_dir_idx);
+        return res;
 }
 
-OpenedFile *IVFS::AddOpenedFile(int idx, bool want_read, bool want_write)
+/* Moves up to len bytes between the file, starting at offset, and the
+ * segments.  Blocks lying consecutively in a storage are pinned and
+ * copied as one area, up to max_copy_run blocks at a time, each filled
+ * from as many segments as it spans. */
+size_t IVFS::CopyV(Inode *in, const struct iovec *iov, int iovcnt,
+                   off_t offset, size_t len, bool to_file)
 {
-        OpenedFileItem *tmp = new OpenedFileItem;
-        tmp->file = new OpenedFile;
-        tmp->file->opened = 1;
-        tmp->file->perm_read = want_read;
-        tmp->file->perm_write = want_write;
-        tmp->file->defer_delete = false;
-        tmp->file->inode_idx = idx;
-        im.ReadInode(&tmp->file->in, idx);
-        tmp->next = first;
-        first = tmp;
-        return tmp->file;
+        if (pool.Workers() > 0 && len >= parallel_min &&
+            CopyParallel(in, iov, iovcnt, offset, len, to_file))
+                return len;
+        size_t done = 0, seg_off = 0, bs = bm.BlockSize();
+        int seg = 0;
+        while (done < len && seg < iovcnt) {
+                if (seg_off == iov[seg].iov_len) {
+                        seg++;
+                        seg_off = 0;
+                        continue;
+                }
+                off_t pos = offset + done, num = pos / bs;
+                uint32_t run = 1;
+                BlockAddress addr = to_file && num >= in->blk_size
+                                  ? FileBlock(in, num)
+                                  : bm.GetRun(in, num, run);
+                size_t in_area = pos % bs;
+                size_t area_len = run * bs - in_area;
+                if (area_len > len - done)
+                        area_len = len - done;
+                if (area_len > max_copy_run * bs - in_area)
+                        area_len = max_copy_run * bs - in_area;
+                run = (in_area + area_len + bs - 1) / bs;
+                char *area = (char*)bm.PinRun(addr, run);
+                if (!area)
+                        break;
+                size_t area_end = in_area + area_len;
+                while (in_area < area_end && seg < iovcnt) {
+                        size_t n = iov[seg].iov_len - seg_off;
+                        if (n > area_end - in_area)
+                                n = area_end - in_area;
+                        char *p = (char*)iov[seg].iov_base + seg_off;
+                        if (to_file)
+                                memcpy(area + in_area, p, n);
+                        else
+                                memcpy(p, area + in_area, n);
+                        in_area += n;
+                        seg_off += n;
+                        done += n;
+                        if (seg_off == iov[seg].iov_len) {
+                                seg++;
+                                seg_off = 0;
+                        }
+                }
+                bm.UnpinRun(addr, run, to_file);
+        }
+        return done;
 }
 
-OpenedFile *IVFS::SearchOpenedFile(int idx) const
+/* Splits a transfer over blocks lying in several storages into one task
+ * per storage, run at once on the I/O pool, each pinning and copying the
+ * areas of its storage in order.  Returns false, leaving the transfer to
+ * the caller, when part of the range has no blocks yet, all of it lies in
+ * one storage or a task could not pin its blocks. */
+bool IVFS::CopyParallel(Inode *in, const struct iovec *iov, int iovcnt,
+                        off_t offset, size_t len, bool to_file)
 {
-        OpenedFileItem *tmp;
-        for (tmp = first; tmp; tmp = tmp->next) {
-                if (tmp->file->inode_idx == idx)
-                        return tmp->file;
+        size_t done = 0, bs = bm.BlockSize();
+        CopyArea *areas = new CopyArea[len / bs + 2];
+        uint32_t storages[Superblock::max_storage_amount];
+        int count = 0, storages_amount = 0;
+        while (done < len) {
+                off_t pos = offset + done, num = pos / bs;
+                if (num >= in->blk_size)
+                        break;
+                uint32_t run;
+                CopyArea &a = areas[count++];
+                a.addr = bm.GetRun(in, num, run);
+                a.in_area = pos % bs;
+                a.len = run * bs - a.in_area;
+                if (a.len > len - done)
+                        a.len = len - done;
+                if (a.len > max_copy_run * bs - a.in_area)
+                        a.len = max_copy_run * bs - a.in_area;
+                a.blocks = (a.in_area + a.len + bs - 1) / bs;
+                a.pos = done;
+                done += a.len;
+                int i = 0;
+                while (i < storages_amount &&
+                       storages[i] != a.addr.storage_num)
+                        i++;
+                if (i == storages_amount &&
+                    (uint32_t)i < Superblock::max_storage_amount)
+                        storages[storages_amount++] = a.addr.storage_num;
+        }
+        bool ok = done == len && storages_amount > 1;
+        if (ok) {
+                StripeJob *jobs = new StripeJob[storages_amount];
+                IOTask *tasks = new IOTask[storages_amount];
+                for (int i = 0; i < storages_amount; i++) {
+                        jobs[i].bm = &bm;
+                        jobs[i].iov = iov;
+                        jobs[i].iovcnt = iovcnt;
+                        jobs[i].areas = areas;
+                        jobs[i].areas_amount = count;
+                        jobs[i].storage = storages[i];
+                        jobs[i].to_file = to_file;
+                        jobs[i].failed = false;
+                        tasks[i].run = CopyStripe;
+                        tasks[i].arg = &jobs[i];
+                }
+                pool.Run(tasks, storages_amount);
+                for (int i = 0; i < storages_amount; i++)
+                        ok = ok && !jobs[i].failed;
+                delete[] tasks;
+                delete[] jobs;
         }
-        return 0;
+        delete[] areas;
+        return ok;
 }
 
-void IVFS::DeleteOpenedFile(OpenedFile *ofptr)
+void IVFS::CopyStripe(void *arg)
 {
-        OpenedFileItem **ptr = &first;
-        while (*ptr) {
-                if ((*ptr)->file == ofptr) {
-                        OpenedFileItem *tmp = *ptr;
-                        *ptr = (*ptr)->next;
-                        delete tmp->file;
-                        delete tmp;
-                } else {
-                        ptr = &(*ptr)->next;
+        StripeJob *job = (StripeJob*)arg;
+        for (int i = 0; i < job->areas_amount; i++) {
+                const CopyArea &a = job->areas[i];
+                if (a.addr.storage_num != job->storage)
+                        continue;
+                char *area = (char*)job->bm->PinRun(a.addr, a.blocks);
+                if (!area) {
+                        job->failed = true;
+                        return;
                 }
+                CopySegments(job->iov, job->iovcnt, a.pos, area + a.in_area,
+                             a.len, job->to_file);
+                job->bm->UnpinRun(a.addr, a.blocks, job->to_file);
         }
 }
 
+/* copies len bytes between area and the segments, from byte pos of the
+ * segments on */
+void IVFS::CopySegments(const struct iovec *iov, int iovcnt, size_t pos,
+                        char *area, size_t len, bool to_file)
+{
+        int seg = 0;
+        while (seg < iovcnt && pos >= iov[seg].iov_len) {
+                pos -= iov[seg].iov_len;
+                seg++;
+        }
+        for (; len > 0 && seg < iovcnt; seg++) {
+                size_t n = iov[seg].iov_len - pos;
+                if (n > len)
+                        n = len;
+                char *p = (char*)iov[seg].iov_base + pos;
+                if (to_file)
+                        memcpy(area, p, n);
+                else
+                        memcpy(p, area, n);
+                area += n;
+                len -= n;
+                pos = 0;
+        }
+}
+
+off_t IVFS::Tell(File *fp) const
+{
+        return fp->cur_block * bm.BlockSize() + fp->cur_pos;
+}
+
+/* Cursor reads continuing where the previous one stopped are sequential:
+ * once the reader gets within half a window of the prefetched end, the
+ * window doubles (up to ra_max_window) and the blocks past the end are
+ * prefetched.  Any other read turns readahead off until the reads become
+ * sequential again. */
+void IVFS::Readahead(File *fp, off_t pos, size_t len)
+{
+        if (len == 0)
+                return;
+        off_t bs = bm.BlockSize();
+        off_t first = pos / bs, last = (pos + len - 1) / bs;
+        if (pos != fp->ra_next) {
+                if (fp->ra_window)
+                        __sync_fetch_and_add(&ra_stats.random, 1);
+                fp->ra_next = pos + len;
+                fp->ra_begin = fp->ra_end = fp->ra_window = 0;
+                return;
+        }
+        fp->ra_next = pos + len;
+        if (pos % bs)
+                first++;
+        if (first <= last) {
+                off_t from = first > fp->ra_begin ? first : fp->ra_begin;
+                off_t to = last + 1 < fp->ra_end ? last + 1 : fp->ra_end;
+                off_t hits = to > from ? to - from : 0;
+                __sync_fetch_and_add(&ra_stats.hits, hits);
+                __sync_fetch_and_add(&ra_stats.misses, last + 1 - first - hits);
+        }
+        if (last + 1 + fp->ra_window / 2 < fp->ra_end)
+                return;
+        fp->ra_window = fp->ra_window ? fp->ra_window * 2 : ra_min_window;
+        if (fp->ra_window > ra_max_window)
+                fp->ra_window = ra_max_window;
+        off_t from = fp->ra_end > last + 1 ? fp->ra_end : last + 1;
+        OpenedFile *ofptr = fp->master;
+        if (ofptr->perm_write)
+                pthread_mutex_lock(&ofptr->mtx);
+        off_t count = (ofptr->in.byte_size + bs - 1) / bs - from;
+        if (count > fp->ra_window)
+                count = fp->ra_window;
+        off_t got = count > 0 ? bm.Prefetch(&ofptr->in, from, count) : 0;
+        if (ofptr->perm_write)
+                pthread_mutex_unlock(&ofptr->mtx);
+        if (fp->ra_end <= first)
+                fp->ra_begin = from;
+        fp->ra_end = from + got;
+        __sync_fetch_and_add(&ra_stats.prefetched, got);
+}
+
+void IVFS::MoveCursor(File *fp, off_t pos)
+{
+        OpenedFile *ofptr = fp->master;
+        off_t bs = bm.BlockSize();
+        off_t num = pos / bs;
+        fp->cur_pos = pos % bs;
+        if (num == fp->cur_block)
+                return;
+        bm.UnpinBlock(fp->block, ofptr->perm_write);
+        fp->cur_block = num;
+        fp->block = 0;
+        if (ofptr->perm_write) {
+                pthread_mutex_lock(&ofptr->mtx);
+                fp->block = (char*)bm.PinBlock(MapBlock(fp, num));
+                pthread_mutex_unlock(&ofptr->mtx);
+        } else if (num < (ofptr->in.byte_size + bs - 1) / bs) {
+                fp->block = (char*)bm.PinBlock(MapBlock(fp, num));
+        }
+}
+
+/* Block num of the file through the handle: the last run of consecutive
+ * blocks found is kept, and for files with an indirect block map so is
+ * the pinned map block in use, so a cursor moving along the file walks
+ * the map once per run or map block rather than once per block.  Blocks
+ * never move while the file is open (a writer is alone and only
+ * appends), so what the handle keeps stays valid.  A writer past the end
+ * gets the block appended. */
+BlockAddress IVFS::MapBlock(File *fp, off_t num)
+{
+        Inode *in = &fp->master->in;
+        if (num >= fp->map_first && num < fp->map_first + fp->map_len) {
+                BlockAddress addr = fp->map_start;
+                addr.block_num += num - fp->map_first;
+                return addr;
+        }
+        if (num >= in->blk_size) {
+                if (fp->master->perm_write)
+                        return FileBlock(in, num);
+                return bm.GetBlock(in, num);
+        }
+        off_t i = num - fp->map_block_first;
+        if (fp->map_block && i >= 0 && i < fp->map_block_count)
+                return fp->map_block[i];
+        bm.UnpinBlock(fp->map_block);
+        fp->map_block = bm.PinMapBlock(in, num, fp->map_block_first,
+                                       fp->map_block_count);
+        if (fp->map_block)
+                return fp->map_block[num - fp->map_block_first];
+        uint32_t run;
+        fp->map_start = bm.GetRun(in, num, run);
+        fp->map_first = num;
+        fp->map_len = run;
+        return fp->map_start;
+}
+
+/* block num of the file, appending blocks up to it when it lies past the
+ * end; the caller holds the file lock */
+BlockAddress IVFS::FileBlock(Inode *in, off_t num)
+{
+        if (num < in->blk_size)
+                return bm.GetBlock(in, num);
+        BlockAddress addr;
+        do {
+                off_t old_size = in->blk_size;
+                addr = bm.AddBlock(in);
+                if (in->blk_size == old_size)
+                        break;
+        } while (in->blk_size <= num);
+        return addr;
+}
+
+/* blocks past byte_size hold whatever was there before, so a write
+ * leaving a gap clears it */
+bool IVFS::ZeroRange(Inode *in, off_t from, off_t to)
+{
+        size_t bs = bm.BlockSize();
+        while (from < to) {
+                size_t in_block = from % bs;
+                size_t n = bs - in_block;
+                if ((off_t)n > to - from)
+                        n = to - from;
+                char *block = (char*)bm.PinBlock(FileBlock(in, from / bs));
+                if (!block)
+                        return false;
+                memset(block + in_block, 0, n);
+                bm.UnpinBlock(block, true);
+                from += n;
+        }
+        return true;
+}
+
+void IVFS::RecursiveDeletion(int idx)
+{
+        Inode in;
+        im.ReadInode(&in, idx);
+        if (in.is_dir) {
+                DirRecordList *ls = dm.List(&in);
+                for (DirRecordList *tmp = ls; tmp; tmp = tmp->next)
+                        RecursiveDeletion(tmp->inode_idx);
+                DirManager::FreeList(ls);
+        }
+        if (!files.MarkDeleted(idx))
+                bm.FreeBlocks(&in);
+        im.FreeInode(idx);
+}
+
+bool IVFS::ConvertTree(int idx)
+{
+        if (!dm.Convert(idx))
+                return false;
+        Inode in;
+        im.ReadInode(&in, idx);
+        bool res = true;
+        DirRecordList *ls = dm.List(&in);
+        for (DirRecordList *tmp = ls; tmp; tmp = tmp->next) {
+                if (IsDirectory(tmp->inode_idx))
+                        res = ConvertTree(tmp->inode_idx) && res;
+        }
+        DirManager::FreeList(ls);
+        return res;
+}
+
 int IVFS::SearchInode(const char *path, bool create_perm, bool mkdr)
 {
         int dir_idx = 0, idx = 0;
-        char filename[max_name_len];
+        char filename[max_name_len + 1];
         while (*path) {
                 path = PathParsing(path, filename);
-                fprintf(stderr, "Searching for file <%s> ", filename);
-                fprintf(stderr, "in directory %d...\n", dir_idx);
-                idx = SearchFileInDir(dir_idx, filename);
+                bool cached = dcache.Lookup(dir_idx, filename, idx);
+                if (!cached || (idx == -1 && create_perm)) {
+                        idx = LockedLookup(dir_idx, filename, create_perm,
+                                           *path || mkdr);
+                        UnlockDir(dir_idx);
+                }
                 if (idx == -1) {
                         fprintf(stderr, "File <%s> not found\n", filename);
-                        if (!create_perm) {
-                                fputs("Creation is not permitted\n", stderr);
-                                return -1;
-                        }
-                        idx = CreateFileInDir(dir_idx, filename, *path || mkdr);
-                        fprintf(stderr, "Created: %s [%d]\n", filename, idx); 
+                        fputs("Creation is not permitted\n", stderr);
+                        return -1;
                 }
                 dir_idx = idx;
         }
@@ -387,28 +1100,69 @@ int IVFS::SearchInode(const char *path, bool create_perm, bool mkdr)
 
 int IVFS::SearchFileInDir(int dir_idx, const char *name)
 {
-        int retval = -1;
-        Inode dir;
-        im.ReadInode(&dir, dir_idx);
-        if (!dir.is_dir) {
-                fprintf(stderr, "%d not directory\n", dir_idx);
-                return -1;
-        }
-        DirRecordList *ptr = ReadDirectory(&dir);
-        fputs("Files in current directory:\n", stderr);
-        for (DirRecordList *tmp = ptr; tmp; tmp = tmp->next) {
-                fprintf(stderr, "%s [%d]\n", tmp->filename, tmp->inode_idx);
+        int idx;
+        if (dcache.Lookup(dir_idx, name, idx))
+                return idx;
+        idx = dm.Lookup(dir_idx, name);
+        if (idx != -1 || IsDirectory(dir_idx))
+                dcache.Insert(dir_idx, name, idx);
+        return idx;
+}
+
+/* returns with the directory locked, shared when the name was found and
+ * exclusive when it had to be created; the caller calls UnlockDir() */
+int IVFS::LockedLookup(int dir_idx, const char *name, bool create, bool is_dir)
+{
+        LockDir(dir_idx, false);
+        int idx = SearchFileInDir(dir_idx, name);
+        if (idx != -1 || !create)
+                return idx;
+        UnlockDir(dir_idx);
+        LockDir(dir_idx, true);
+        idx = SearchFileInDir(dir_idx, name);
+        if (idx == -1) {
+                fprintf(stderr, "File <%s> not found\n", name);
+                idx = CreateFileInDir(dir_idx, name, is_dir);
+                fprintf(stderr, "Created: %s [%d]\n", name, idx); 
         }
-        for (DirRecordList *tmp = ptr; tmp; tmp = tmp->next) {
-                if (!strcmp(tmp->filename, name)) {
-                        retval = tmp->inode_idx;
-                        fprintf(stderr, "Found: <%s> [%d]\n",
-                                tmp->filename, tmp->inode_idx);
-                        break;
-                }
+        return idx;
+}
+
+void IVFS::LockDir(int idx, bool exclusive)
+{
+        pthread_rwlock_t *lock = &dir_locks[idx % dir_locks_amount];
+        if (exclusive)
+                pthread_rwlock_wrlock(lock);
+        else
+                pthread_rwlock_rdlock(lock);
+}
+
+void IVFS::UnlockDir(int idx)
+{
+        pthread_rwlock_unlock(&dir_locks[idx % dir_locks_amount]);
+}
+
+void IVFS::LockDirs(int first_idx, int second_idx)
+{
+        int a = first_idx % dir_locks_amount;
+        int b = second_idx % dir_locks_amount;
+        if (a > b) {
+                int t = a;
+                a = b;
+                b = t;
         }
-        FreeDirRecordList(ptr);
-        return retval;
+        pthread_rwlock_wrlock(&dir_locks[a]);
+        if (b != a)
+                pthread_rwlock_wrlock(&dir_locks[b]);
+}
+
+void IVFS::UnlockDirs(int first_idx, int second_idx)
+{
+        int a = first_idx % dir_locks_amount;
+        int b = second_idx % dir_locks_amount;
+        pthread_rwlock_unlock(&dir_locks[a]);
+        if (b != a)
+                pthread_rwlock_unlock(&dir_locks[b]);
 }
 
 int IVFS::CreateFileInDir(int dir_idx, const char *name, bool is_dir)
@@ -419,81 +1173,28 @@ int IVFS::CreateFileInDir(int dir_idx, const char *name, bool is_dir)
         in.is_dir = is_dir;
         in.byte_size = 0;
         in.blk_size = 0;
-        bm.AddBlock(&in);
+        if (is_dir)
+                dm.InitDirectory(&in);
+        else
+                bm.AddBlock(&in);
         int idx = im.GetInode();
         im.WriteInode(&in, idx);
         CreateDirRecord(dir_idx, name, idx);
-        if (is_dir) {
-                DirRecord *arr = (DirRecord*)bm.ReadBlock(in.block[0]);
-                memset(arr, 0, bm.BlockSize());
-                bm.UnmapBlock(arr);
-        }
         return idx;
 }
 
 void IVFS::CreateDirRecord(int dir_idx, const char *filename, int inode_idx)
 {
-        Inode dir;
-        im.ReadInode(&dir, dir_idx);
-        for (off_t i = 0; i < dir.blk_size; i++) {
-                BlockAddress addr = bm.GetBlock(&dir, i);
-                DirRecord *arr = (DirRecord*)bm.ReadBlock(addr);
-                for (size_t j = 0; j < bm.BlockSize() / sizeof(*arr); j++) {
-                        if (!arr[j].name[0]) {
-                                strcpy(arr[j].name, filename);
-                                sprintf(arr[j].idx, "%d", inode_idx);
-                                bm.UnmapBlock(arr);
-                                return;
-                        }
-                }
-                bm.UnmapBlock(arr);
-        }
-        BlockAddress addr = bm.AddBlock(&dir);
-        DirRecord *arr = (DirRecord*)bm.ReadBlock(addr);
-        memset(arr, 0, bm.BlockSize());
-        strcpy(arr[0].name, filename);
-        sprintf(arr[0].idx, "%d", inode_idx);
-        bm.UnmapBlock(arr);
-        im.WriteInode(&dir, dir_idx);
+        if (dm.Insert(dir_idx, filename, inode_idx))
+                dcache.Insert(dir_idx, filename, inode_idx);
+        else
+                dcache.Invalidate(dir_idx, filename);
 }
 
 void IVFS::DeleteDirRecord(int dir_idx, const char *filename)
 {
-        Inode dir;
-        im.ReadInode(&dir, dir_idx);
-        for (off_t i = 0; i < dir.blk_size; i++) {
-                BlockAddress addr = bm.GetBlock(&dir, i);
-                DirRecord *arr = (DirRecord*)bm.ReadBlock(addr);
-                for (size_t j = 0; j < bm.BlockSize() / sizeof(*arr); j++) {
-                        if (!strcmp(arr[j].name, filename)) {
-                                memset(&arr[j], 0, sizeof(arr[j]));
-                                bm.UnmapBlock(arr);
-                                return;
-                        }
-                }
-                bm.UnmapBlock(arr);
-        }
-        im.WriteInode(&dir, dir_idx);
-}
-
-DirRecordList *IVFS::ReadDirectory(Inode *dir)
-{
-        DirRecordList *retval = 0;
-        for (off_t i = 0; i < dir->blk_size; i++) {
-                BlockAddress addr = bm.GetBlock(dir, i);
-                DirRecord *arr = (DirRecord*)bm.ReadBlock(addr);
-                for (size_t j = 0; j < bm.BlockSize() / sizeof(*arr); j++) {
-                        if (!arr[j].name[0])
-                                continue;
-                        DirRecordList *tmp = new DirRecordList;
-                        tmp->filename = strdup(arr[j].name);
-                        tmp->inode_idx = atoi(arr[j].idx);
-                        tmp->next = retval;
-                        retval = tmp;
-                }
-                bm.UnmapBlock(arr);
-        }
-        return retval;
+        dm.Remove(dir_idx, filename);
+        dcache.Invalidate(dir_idx, filename);
 }
 
 void IVFS::CreateRootDirectory()
@@ -504,7 +1205,7 @@ void IVFS::CreateRootDirectory()
         root.is_dir = true;
         root.byte_size = 0;
         root.blk_size = 0;
-        bm.AddBlock(&root);
+        dm.InitDirectory(&root);
         im.WriteInode(&root, 0);
 }
 
@@ -515,21 +1216,59 @@ bool IVFS::IsDirectory(int idx)
         return in.is_dir;
 }
 
-void IVFS::FreeDirRecordList(DirRecordList *ptr)
+bool IVFS::Mount(const char *path, const Geometry *mkfs, size_t cache_size)
 {
-        while (ptr) {
-                DirRecordList *tmp = ptr;
-                ptr = ptr->next;
-                free((void*)tmp->filename);
-                delete tmp;
+        int res;
+        Geometry geometry;
+        if (mkfs && !Superblock::Valid(*mkfs))
+                return false;
+        dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+        if (dir_fd == -1) {
+                perror("open");
+                return false;
         }
+        if (mkfs && !CreateFileSystem(dir_fd, *mkfs)) {
+                fputs("Failed to make the file system\n", stderr);
+                return false;
+        }
+        if (!Superblock::Read(dir_fd, geometry)) {
+                fputs("Failed to read the superblock\n", stderr);
+                return false;
+        }
+        if (!journal.Open(dir_fd)) {
+                fputs("Failed to replay the journal\n", stderr);
+                return false;
+        }
+        res = im.Init(dir_fd, geometry);
+        if (!res) {
+                fputs("Failed to start InodeManager\n", stderr);
+                return false;
+        }
+        res = bm.Init(dir_fd, geometry, cache_size);
+        if (!res) {
+                fputs("Failed to start BlockManager\n", stderr);
+                return false;
+        }
+        if (mkfs) {
+                CreateRootDirectory();
+                Sync();
+        }
+        if (geometry.stripe_blocks && geometry.storage_amount > 1) {
+                int workers = geometry.storage_amount - 1;
+                pool.Start(workers < max_io_workers ? workers : max_io_workers);
+        }
+        dcache.Init();
+        fputs("Virtual File System started successfully\n", stderr);
+        return true;
 }
 
-void IVFS::CreateFileSystem(int dir_fd)
+bool IVFS::CreateFileSystem(int dir_fd, const Geometry &geometry)
 {
-        InodeManager::CreateInodeSpace(dir_fd);
-        BlockManager::CreateBlockSpace(dir_fd);
-        BlockManager::CreateFreeBlockArray(dir_fd);
+        return InodeManager::CreateInodeSpace(dir_fd, geometry) &&
+               BlockManager::CreateBlockSpace(dir_fd, geometry) &&
+               BlockManager::CreateFreeBlockArray(dir_fd, geometry) &&
+               Journal::CreateJournal(dir_fd) &&
+               Superblock::Write(dir_fd, geometry);
 }
 
 const char *IVFS::PathParsing(const char *path, char *file)
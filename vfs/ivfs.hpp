@@ -1,22 +1,38 @@
 #ifndef IVFS_HPP_SENTRY
 #define IVFS_HPP_SENTRY
 
+#include <sys/uio.h>
 #include "inodemanager.hpp"
 #include "blockmanager.hpp"
+#include "blockcache.hpp"
+#include "dirmanager.hpp"
+#include "dentrycache.hpp"
+#include "openfiletable.hpp"
+#include "superblock.hpp"
+#include "iopool.hpp"
+#include "journal.hpp"
+#include "asyncqueue.hpp"
 
-struct DirRecordList {
-        const char *filename;
-        int32_t inode_idx;
-        DirRecordList *next;
+struct ReadaheadStats {
+        uint64_t prefetched;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t random;
 };
 
-struct OpenedFile {
-        int inode_idx;
-        int opened;
-        bool perm_read;
-        bool perm_write;
-        bool defer_delete;
-        struct Inode in;
+/* A read-only span of file data inside the storage mapping */
+struct FileView {
+        const char *data;
+        size_t len;
+};
+
+/* One name in a directory; size is the file's length as of its last
+ * close */
+struct DirListing {
+        char name[DirManager::max_name_len + 1];
+        bool is_dir;
+        off_t size;
+        DirListing *next;
 };
 
 struct File {
@@ -25,11 +41,46 @@ private:
         off_t cur_block;
         char *block;
         OpenedFile *master;
+        off_t map_first;
+        off_t map_len;
+        BlockAddress map_start;
+        BlockAddress *map_block;
+        off_t map_block_first;
+        off_t map_block_count;
+        off_t ra_next;
+        off_t ra_begin;
+        off_t ra_end;
+        off_t ra_window;
         friend class IVFS;
 };
 
+/* Locking: ns_lock is taken shared by every namespace operation and
+ * exclusive only by the ones that restructure the tree (removing a
+ * directory, moving a directory to another parent, converting the
+ * directories).  Under it a directory's entries are guarded by its stripe
+ * of dir_locks, shared for lookups and exclusive for changes; a path walk
+ * holds one directory lock at a time and Rename takes two in stripe
+ * order.  OpenedFile::mtx guards the inode copy of an opened file.
+ *
+ * Create, Remove, Rename, creating or truncating Open and closing a file
+ * opened for writing commit the metadata changes to the journal before
+ * returning, with no lock held; the batch calls commit once for all of
+ * their paths.  Writes only log their changes and check the journal's
+ * size. */
 class IVFS {
-        static const int max_name_len = 52;
+        static const int max_name_len = DirManager::max_name_len;
+        static const int dir_locks_amount = 64;
+        static const uint32_t max_copy_run = 256;
+        static const size_t parallel_min = 256 << 10;
+        static const int max_io_workers = 8;
+        static const off_t ra_min_window = 4;
+        static const off_t ra_max_window = 256;
+        enum OpResult { op_failed, op_done, op_exclusive };
+        struct BatchEntry {
+                char *dirname;
+                char filename[max_name_len + 1];
+                bool pending;
+        };
         struct FileOpenFlags {
                 bool r_flag;
                 bool w_flag;
@@ -37,50 +88,118 @@ class IVFS {
                 bool c_flag;
                 bool t_flag;
         };
-#pragma pack(push, 8)
-        struct DirRecord {
-                char name[max_name_len + 1];
-                char idx[8];
+        struct CopyArea {
+                BlockAddress addr;
+                uint32_t blocks;
+                size_t in_area;
+                size_t len;
+                size_t pos;
         };
-#pragma pack(pop)
-        struct OpenedFileItem {
-                OpenedFile *file;
-                OpenedFileItem *next;
+        struct StripeJob {
+                BlockManager *bm;
+                const struct iovec *iov;
+                int iovcnt;
+                const CopyArea *areas;
+                int areas_amount;
+                uint32_t storage;
+                bool to_file;
+                bool failed;
         };
         int dir_fd;
-        OpenedFileItem *first;
+        Journal journal;        /* goes after the managers have synced */
         InodeManager im;
         BlockManager bm;
-        pthread_mutex_t mtx;
+        DirManager dm;
+        DentryCache dcache;
+        OpenFileTable files;
+        IOPool pool;
+        IOPool async_pool;
+        pthread_rwlock_t ns_lock;
+        pthread_rwlock_t dir_locks[dir_locks_amount];
+        ReadaheadStats ra_stats;
+        friend class AsyncQueue;
 public:
         IVFS();
         ~IVFS();
-        bool Boot(const char *path, bool makefs = false);
+        bool Boot(const char *path, bool makefs = false,
+                  size_t cache_size = 0);
+        bool Boot(const char *path, const Geometry &geometry,
+                  size_t cache_size = 0);
         bool Create(const char *path, bool directory = false);
         bool Remove(const char *path, bool recursive = false);
+        int CreateBatch(const char * const *paths, int count,
+                        bool directory = false);
+        int RemoveBatch(const char * const *paths, int count,
+                        bool recursive = false);
         bool Rename(const char *oldpath, const char *newpath);
+        int List(const char *path, DirListing **listing);
+        static void FreeListing(DirListing *listing);
         File *Open(const char *path, const char *flags);
         void Close(File *fp);
         ssize_t Read(File *fp, char *buf, size_t len);
         ssize_t Write(File *fp, const char *buf, size_t len);
+        ssize_t PRead(File *fp, char *buf, size_t len, off_t offset);
+        ssize_t PWrite(File *fp, const char *buf, size_t len, off_t offset);
+        ssize_t ReadV(File *fp, const struct iovec *iov, int iovcnt);
+        ssize_t WriteV(File *fp, const struct iovec *iov, int iovcnt);
+        ssize_t PReadV(File *fp, const struct iovec *iov, int iovcnt,
+                       off_t offset);
+        ssize_t PWriteV(File *fp, const struct iovec *iov, int iovcnt,
+                        off_t offset);
+        int MapRange(File *fp, off_t offset, size_t len,
+                     FileView *views, int max_views);
+        void ReleaseViews(const FileView *views, int count);
         off_t Lseek(File *fp, off_t offset, int whence);
+        void Sync();
+        bool ConvertDirectories();
         off_t Size(File *fp) const { return fp->master->in.byte_size; }
+        Geometry GetGeometry() const { return bm.GetGeometry(); }
+        BlockCacheStats CacheStats() const { return bm.CacheStats(); }
+        ReadaheadStats ReadaheadCounters() const { return ra_stats; }
 private:
+        BatchEntry *SplitPaths(const char * const *paths, int &count);
+        static void FreeEntries(BatchEntry *entries, int count);
+        static int CompareEntries(const void *a, const void *b);
+        int CreateGroup(BatchEntry *entries, int count, bool is_dir);
+        int CreateEntries(int dir_idx, const char **names, int count,
+                          bool is_dir);
+        int RemoveGroup(BatchEntry *entries, int count, bool recursive,
+                        bool exclusive);
+        OpResult RenameEntry(const char *old_dirname, const char *old_filename,
+                             const char *new_dirname, const char *new_filename,
+                             bool exclusive);
+        size_t CopyV(Inode *in, const struct iovec *iov, int iovcnt,
+                     off_t offset, size_t len, bool to_file);
+        bool CopyParallel(Inode *in, const struct iovec *iov, int iovcnt,
+                          off_t offset, size_t len, bool to_file);
+        static void CopyStripe(void *arg);
+        static void CopySegments(const struct iovec *iov, int iovcnt,
+                                 size_t pos, char *area, size_t len,
+                                 bool to_file);
+        off_t Tell(File *fp) const;
+        void CommitMetadata();
+        void Readahead(File *fp, off_t pos, size_t len);
+        void MoveCursor(File *fp, off_t pos);
+        BlockAddress FileBlock(Inode *in, off_t num);
+        BlockAddress MapBlock(File *fp, off_t num);
+        bool ZeroRange(Inode *in, off_t from, off_t to);
         void RecursiveDeletion(int idx);
-        OpenedFile *OpenFile(int idx, bool want_read, bool want_write);
-        OpenedFile *AddOpenedFile(int idx, bool want_read, bool want_write);
-        OpenedFile *SearchOpenedFile(int idx) const;
-        void DeleteOpenedFile(OpenedFile *ofptr);
+        bool ConvertTree(int idx);
         int SearchInode(const char *path, bool create_perm, bool mkdr = false);
         int SearchFileInDir(int dir_idx, const char *name);
+        int LockedLookup(int dir_idx, const char *name, bool create,
+                         bool is_dir);
+        void LockDir(int idx, bool exclusive);
+        void UnlockDir(int idx);
+        void LockDirs(int first_idx, int second_idx);
+        void UnlockDirs(int first_idx, int second_idx);
         int CreateFileInDir(int dir_idx, const char *name, bool is_dir);
         void CreateDirRecord(int dir_idx, const char *filename, int idx);
         void DeleteDirRecord(int dir_idx, const char *filename);
-        DirRecordList *ReadDirectory(Inode *dir);
         void CreateRootDirectory();
         bool IsDirectory(int idx);
-        static void FreeDirRecordList(DirRecordList *ptr);
-        static void CreateFileSystem(int dir_fd);
+        bool Mount(const char *path, const Geometry *mkfs, size_t cache_size);
+        static bool CreateFileSystem(int dir_fd, const Geometry &geometry);
         static const char *PathParsing(const char *path, char *file);
         static void GetDirectory(const char *path, char *dir, char *file);
         static bool CheckPath(const char *path);
@@ -0,0 +1,377 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "journal.hpp"
+#include "superblock.hpp"
+
+Journal::Journal()
+        : dir_fd(-1), fd(-1), buf(0), buf_len(0), buf_cap(0), spare(0),
+        spare_cap(0), base(0), written(0), durable(0), committed(0),
+        appended(0), flushing(false)
+{
+        pthread_mutex_init(&mtx, 0);
+        pthread_cond_init(&cond, 0);
+}
+
+/* the owner syncs the structures before the journal goes away, so the
+ * records are no longer needed */
+Journal::~Journal()
+{
+        if (fd != -1) {
+                if (ftruncate(fd, 0) == -1)
+                        perror("Journal::~Journal(): ftruncate");
+                close(fd);
+        }
+        delete[] buf;
+        delete[] spare;
+        pthread_mutex_destroy(&mtx);
+        pthread_cond_destroy(&cond);
+}
+
+/* replays what a crash left in the journal and starts an empty one */
+bool Journal::Open(int dir)
+{
+        dir_fd = dir;
+        if (!Replay(dir_fd))
+                return false;
+        fd = openat(dir_fd, "journal", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                perror("Journal::Open(): open");
+                return false;
+        }
+        if (fdatasync(fd) == -1)
+                perror("Journal::Open(): fdatasync");
+        return true;
+}
+
+void Journal::Log(uint32_t target, off_t offset, const void *data, size_t len)
+{
+        Append(record_image, target, offset, data, len);
+}
+
+/* the range is free space from now on, earlier images of it must not be
+ * replayed over whatever it will hold */
+void Journal::Revoke(uint32_t target, off_t offset, size_t len)
+{
+        Append(record_revoke, target, offset, 0, len);
+}
+
+void Journal::Commit()
+{
+        if (fd == -1)
+                return;
+        pthread_mutex_lock(&mtx);
+        bool open = committed < appended;
+        pthread_mutex_unlock(&mtx);
+        if (open)
+                Append(record_commit, 0, 0, 0, 0);
+        pthread_mutex_lock(&mtx);
+        uint64_t target = appended;
+        while (durable < target) {
+                if (flushing) {
+                        pthread_cond_wait(&cond, &mtx);
+                        continue;
+                }
+                /* lead the group: write out everything logged so far */
+                char *data = buf;
+                size_t len = buf_len, cap = buf_cap;
+                off_t pos = written - base;
+                uint64_t end = appended;
+                buf = spare;
+                buf_cap = spare_cap;
+                buf_len = 0;
+                spare = data;
+                spare_cap = cap;
+                written = end;
+                flushing = true;
+                pthread_mutex_unlock(&mtx);
+                WriteOut(fd, data, len, pos);
+                if (fdatasync(fd) == -1)
+                        perror("Journal::Commit(): fdatasync");
+                pthread_mutex_lock(&mtx);
+                if (durable < end)
+                        durable = end;
+                flushing = false;
+                pthread_cond_broadcast(&cond);
+        }
+        pthread_mutex_unlock(&mtx);
+}
+
+uint64_t Journal::Mark()
+{
+        pthread_mutex_lock(&mtx);
+        uint64_t retval = appended;
+        pthread_mutex_unlock(&mtx);
+        return retval;
+}
+
+/* everything logged up to mark has reached the structures' files */
+void Journal::Checkpoint(uint64_t mark)
+{
+        if (fd == -1)
+                return;
+        pthread_mutex_lock(&mtx);
+        while (flushing)
+                pthread_cond_wait(&cond, &mtx);
+        if (mark > written) {
+                size_t drop = mark - written;
+                memmove(buf, buf + drop, buf_len - drop);
+                buf_len -= drop;
+                written = mark;
+        }
+        if (durable < mark)
+                durable = mark;
+        if (mark > base)
+                Rewrite(mark);
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mtx);
+}
+
+bool Journal::Full()
+{
+        pthread_mutex_lock(&mtx);
+        bool retval = appended - base > (uint64_t)max_size;
+        pthread_mutex_unlock(&mtx);
+        return retval;
+}
+
+bool Journal::CreateJournal(int dir_fd)
+{
+        int fd = openat(dir_fd, "journal", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                perror("Journal::CreateJournal(): open");
+                return false;
+        }
+        close(fd);
+        return true;
+}
+
+void Journal::Append(uint32_t type, uint32_t target, off_t offset,
+                     const void *data, size_t len)
+{
+        if (fd == -1)
+                return;
+        Record r;
+        r.magic = record_magic;
+        r.type = type;
+        r.target = target;
+        r.len = len;
+        r.offset = offset;
+        r.sum = 0;
+        r.unused = 0;
+        size_t data_len = type == record_image ? len : 0;
+        r.sum = Checksum(Checksum(2166136261u, &r, sizeof(r)), data, data_len);
+        pthread_mutex_lock(&mtx);
+        size_t need = buf_len + sizeof(r) + data_len;
+        if (need > buf_cap) {
+                size_t cap = buf_cap ? buf_cap * 2 : flush_size;
+                while (cap < need)
+                        cap *= 2;
+                char *fresh = new char[cap];
+                memcpy(fresh, buf, buf_len);
+                delete[] buf;
+                buf = fresh;
+                buf_cap = cap;
+        }
+        memcpy(buf + buf_len, &r, sizeof(r));
+        memcpy(buf + buf_len + sizeof(r), data, data_len);
+        buf_len += sizeof(r) + data_len;
+        appended += sizeof(r) + data_len;
+        if (type == record_commit)
+                committed = appended;
+        /* a long run of changes with no commit goes out unsynced */
+        if (buf_len >= flush_size && !flushing) {
+                WriteOut(fd, buf, buf_len, written - base);
+                written += buf_len;
+                buf_len = 0;
+        }
+        pthread_mutex_unlock(&mtx);
+}
+
+bool Journal::WriteOut(int fd, const char *data, size_t len, off_t pos)
+{
+        while (len > 0) {
+                ssize_t res = pwrite(fd, data, len, pos);
+                if (res <= 0) {
+                        perror("Journal::WriteOut(): pwrite");
+                        return false;
+                }
+                data += res;
+                len -= res;
+                pos += res;
+        }
+        return true;
+}
+
+/* drops the records up to mark from the file, keeping the later ones in
+ * a new file renamed over it */
+void Journal::Rewrite(uint64_t mark)
+{
+        size_t keep = written - mark;
+        if (keep == 0) {
+                if (ftruncate(fd, 0) == -1 || fdatasync(fd) == -1)
+                        perror("Journal::Checkpoint(): ftruncate");
+                base = mark;
+                return;
+        }
+        char *tail = new char[keep];
+        ssize_t res = pread(fd, tail, keep, mark - base);
+        int new_fd = -1;
+        if (res == (ssize_t)keep)
+                new_fd = openat(dir_fd, "journal.new",
+                                O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (new_fd == -1) {
+                perror("Journal::Checkpoint(): open");
+                delete[] tail;
+                return;
+        }
+        bool ok = WriteOut(new_fd, tail, keep, 0) && fdatasync(new_fd) != -1;
+        delete[] tail;
+        if (!ok || renameat(dir_fd, "journal.new", dir_fd, "journal") == -1) {
+                perror("Journal::Checkpoint(): rename");
+                close(new_fd);
+                return;
+        }
+        close(fd);
+        fd = new_fd;
+        base = mark;
+}
+
+bool Journal::Replay(int dir_fd)
+{
+        int jfd = openat(dir_fd, "journal", O_RDONLY);
+        if (jfd == -1)
+                return true;    /* made before the journal existed */
+        struct stat st;
+        if (fstat(jfd, &st) == -1) {
+                perror("Journal::Replay(): fstat");
+                close(jfd);
+                return false;
+        }
+        size_t size = st.st_size, pos = 0, end = 0;
+        char *data = new char[size + 1];
+        while (pos < size) {
+                ssize_t res = pread(jfd, data + pos, size - pos, pos);
+                if (res <= 0)
+                        break;
+                pos += res;
+        }
+        close(jfd);
+        size = pos;
+        /* only what a commit record made durable counts */
+        Record r;
+        size_t revokes_amount = 0;
+        for (pos = 0; ReadRecord(data, size, pos, r); ) {
+                pos += sizeof(r) + (r.type == record_image ? r.len : 0);
+                if (r.type == record_revoke)
+                        revokes_amount++;
+                if (r.type == record_commit)
+                        end = pos;
+        }
+        Record *revokes = new Record[revokes_amount];
+        size_t *revoke_pos = new size_t[revokes_amount];
+        size_t n = 0;
+        for (pos = 0; pos < end; ) {
+                ReadRecord(data, size, pos, r);
+                if (r.type == record_revoke) {
+                        revokes[n] = r;
+                        revoke_pos[n++] = pos;
+                }
+                pos += sizeof(r) + (r.type == record_image ? r.len : 0);
+        }
+        int fds[storage_base + Superblock::max_storage_amount];
+        for (size_t i = 0; i < sizeof(fds) / sizeof(*fds); i++)
+                fds[i] = -1;
+        bool retval = true;
+        uint32_t applied = 0;
+        for (pos = 0; pos < end; ) {
+                ReadRecord(data, size, pos, r);
+                size_t at = pos;
+                pos += sizeof(r) + (r.type == record_image ? r.len : 0);
+                if (r.type != record_image)
+                        continue;
+                bool revoked = false;
+                for (size_t i = 0; i < n && !revoked; i++) {
+                        revoked = revoke_pos[i] > at &&
+                                  revokes[i].target == r.target &&
+                                  revokes[i].offset < r.offset + r.len &&
+                                  r.offset < revokes[i].offset + revokes[i].len;
+                }
+                int tfd = TargetFd(dir_fd, fds, r.target);
+                if (revoked || tfd == -1)
+                        continue;
+                if (!WriteOut(tfd, data + at + sizeof(r), r.len, r.offset))
+                        retval = false;
+                applied++;
+        }
+        for (size_t i = 0; i < sizeof(fds) / sizeof(*fds); i++) {
+                if (fds[i] == -1)
+                        continue;
+                if (fsync(fds[i]) == -1) {
+                        perror("Journal::Replay(): fsync");
+                        retval = false;
+                }
+                close(fds[i]);
+        }
+        if (applied)
+                fprintf(stderr, "Journal: %u changes replayed\n", applied);
+        delete[] revokes;
+        delete[] revoke_pos;
+        delete[] data;
+        return retval;
+}
+
+bool Journal::ReadRecord(const char *data, size_t size, size_t pos, Record &r)
+{
+        if (pos + sizeof(r) > size)
+                return false;
+        memcpy(&r, data + pos, sizeof(r));
+        if (r.magic != record_magic || r.type > record_commit)
+                return false;
+        size_t data_len = r.type == record_image ? r.len : 0;
+        if (data_len > size - pos - sizeof(r))
+                return false;
+        Record head = r;
+        head.sum = 0;
+        uint32_t sum = Checksum(2166136261u, &head, sizeof(head));
+        return Checksum(sum, data + pos + sizeof(r), data_len) == r.sum;
+}
+
+int Journal::TargetFd(int dir_fd, int *fds, uint32_t target)
+{
+        if (target >= storage_base + Superblock::max_storage_amount)
+                return -1;
+        if (fds[target] != -1)
+                return fds[target];
+        char name[32];
+        if (target == inode_table)
+                strcpy(name, "inode_space");
+        else if (target == inode_bitmap)
+                strcpy(name, "free_inodes");
+        else if (target == block_bitmap)
+                strcpy(name, "free_blocks");
+        else
+                sprintf(name, "storage%u", target - storage_base);
+        /* a storage the superblock never got to know of stays unused */
+        fds[target] = openat(dir_fd, name, O_RDWR);
+        return fds[target];
+}
+
+/* FNV-1a taken a 32-bit word at a time, block images are long */
+uint32_t Journal::Checksum(uint32_t h, const void *data, size_t len)
+{
+        const unsigned char *p = (const unsigned char*)data;
+        for (; len >= 4; len -= 4, p += 4) {
+                uint32_t word;
+                memcpy(&word, p, sizeof(word));
+                h ^= word;
+                h *= 16777619u;
+        }
+        for (; len > 0; len--, p++) {
+                h ^= *p;
+                h *= 16777619u;
+        }
+        return h;
+}
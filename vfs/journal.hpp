@@ -0,0 +1,86 @@
+#ifndef JOURNAL_HPP_SENTRY
+#define JOURNAL_HPP_SENTRY
+
+#include <cstddef>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Redo log of metadata changes, kept to help recovery after an unclean
+ * shutdown.  A change is recorded as the new image of a byte range of
+ * one of the file system's files (the inode table, the two bitmaps, a
+ * storage block holding a directory or a block map) and appended to a
+ * memory buffer.  Commit() returns once everything logged so far is on
+ * disk: the first thread to arrive writes the buffer out and fsyncs
+ * while later ones wait, so one fsync covers every thread that committed
+ * in the meantime.
+ *
+ * At boot the records up to the last commit are written back into their
+ * files, except images of storage blocks freed later in the log (their
+ * space may hold file data by now), and the journal is emptied.
+ * Checkpoint() drops the records older than a Mark() once the structures
+ * themselves have been synced.
+ *
+ * It is not a write-ahead log and makes no crash-safety promise.  The
+ * structures are changed in place in shared mappings that the kernel may
+ * write back before their records exist, replay only redoes images and
+ * never undoes them, and a commit takes in whatever other threads have
+ * logged so far, finished or not.  A crash can leave any operation half
+ * done, and the file system inconsistent, with or without the journal.
+ * File data is not journaled. */
+class Journal {
+        static const uint32_t record_magic = 0x4C4E524A;
+        static const size_t flush_size = 1 << 20;
+        static const off_t max_size = 64 << 20;
+        enum RecordType { record_image, record_revoke, record_commit };
+        struct Record {
+                uint32_t magic;
+                uint32_t type;
+                uint32_t target;
+                uint32_t len;
+                uint64_t offset;
+                uint32_t sum;
+                uint32_t unused;
+        };
+        int dir_fd;
+        int fd;
+        char *buf;
+        size_t buf_len;
+        size_t buf_cap;
+        char *spare;
+        size_t spare_cap;
+        uint64_t base;
+        uint64_t written;
+        uint64_t durable;
+        uint64_t committed;
+        uint64_t appended;
+        bool flushing;
+        pthread_mutex_t mtx;
+        pthread_cond_t cond;
+public:
+        enum Target { inode_table, inode_bitmap, block_bitmap, storage_base };
+        Journal();
+        ~Journal();
+        bool Open(int dir_fd);
+        void Log(uint32_t target, off_t offset, const void *data, size_t len);
+        void Revoke(uint32_t target, off_t offset, size_t len);
+        void Commit();
+        uint64_t Mark();
+        void Checkpoint(uint64_t mark);
+        bool Full();
+        static bool CreateJournal(int dir_fd);
+private:
+        void Append(uint32_t type, uint32_t target, off_t offset,
+                    const void *data, size_t len);
+        void Rewrite(uint64_t mark);
+        static bool WriteOut(int fd, const char *data, size_t len, off_t pos);
+        static bool Replay(int dir_fd);
+        static bool ReadRecord(const char *data, size_t size, size_t pos,
+                               Record &r);
+        static int TargetFd(int dir_fd, int *fds, uint32_t target);
+        static uint32_t Checksum(uint32_t h, const void *data, size_t len);
+        Journal(const Journal&);
+        void operator=(const Journal&);
+};
+
+#endif /* JOURNAL_HPP_SENTRY */
@@ -0,0 +1,168 @@
+#include <cstring>
+#include "openfiletable.hpp"
+
+OpenFileTable::OpenFileTable(InodeManager &imgr) : im(imgr)
+{
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                pthread_mutex_init(&sh.mtx, 0);
+                sh.table = new OpenedFile*[initial_table_size];
+                sh.table_size = initial_table_size;
+                sh.used = 0;
+                sh.free_list = 0;
+                memset(sh.table, 0, sh.table_size * sizeof(OpenedFile*));
+        }
+}
+
+OpenFileTable::~OpenFileTable()
+{
+        WriteBack();
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                for (size_t j = 0; j < sh.table_size; j++) {
+                        while (sh.table[j]) {
+                                OpenedFile *tmp = sh.table[j];
+                                sh.table[j] = tmp->hash_next;
+                                tmp->hash_next = sh.free_list;
+                                sh.free_list = tmp;
+                        }
+                }
+                while (sh.free_list) {
+                        OpenedFile *tmp = sh.free_list;
+                        sh.free_list = tmp->hash_next;
+                        pthread_mutex_destroy(&tmp->mtx);
+                        delete tmp;
+                }
+                delete[] sh.table;
+                pthread_mutex_destroy(&sh.mtx);
+        }
+}
+
+OpenedFile *OpenFileTable::Open(int idx, bool want_read, bool want_write)
+{
+        Shard &sh = ShardFor(idx);
+        pthread_mutex_lock(&sh.mtx);
+        OpenedFile *ofptr = *Find(sh, idx);
+        if (ofptr) {
+                if (!ofptr->perm_write && !want_write)
+                        ofptr->opened++;
+                else
+                        ofptr = 0;
+                pthread_mutex_unlock(&sh.mtx);
+                return ofptr;
+        }
+        if (sh.used >= sh.table_size)
+                Grow(sh);
+        ofptr = sh.free_list;
+        if (ofptr) {
+                sh.free_list = ofptr->hash_next;
+        } else {
+                ofptr = new OpenedFile;
+                pthread_mutex_init(&ofptr->mtx, 0);
+        }
+        ofptr->inode_idx = idx;
+        ofptr->opened = 1;
+        ofptr->perm_read = want_read;
+        ofptr->perm_write = want_write;
+        ofptr->defer_delete = false;
+        im.ReadInode(&ofptr->in, idx);
+        OpenedFile **head = &sh.table[(idx / shards_amount) &
+                                      (sh.table_size - 1)];
+        ofptr->hash_next = *head;
+        *head = ofptr;
+        sh.used++;
+        pthread_mutex_unlock(&sh.mtx);
+        return ofptr;
+}
+
+/* true when this was the last reference to a file removed while open:
+ * the caller frees its blocks and hands it back with Recycle() */
+bool OpenFileTable::Release(OpenedFile *ofptr)
+{
+        Shard &sh = ShardFor(ofptr->inode_idx);
+        pthread_mutex_lock(&sh.mtx);
+        bool last = --ofptr->opened == 0;
+        bool deleted = ofptr->defer_delete;
+        if (last && !deleted) {
+                im.WriteInode(&ofptr->in, ofptr->inode_idx);
+                OpenedFile **pe = Find(sh, ofptr->inode_idx);
+                *pe = ofptr->hash_next;
+                sh.used--;
+                ofptr->hash_next = sh.free_list;
+                sh.free_list = ofptr;
+        }
+        pthread_mutex_unlock(&sh.mtx);
+        return last && deleted;
+}
+
+void OpenFileTable::Recycle(OpenedFile *ofptr)
+{
+        Shard &sh = ShardFor(ofptr->inode_idx);
+        pthread_mutex_lock(&sh.mtx);
+        ofptr->hash_next = sh.free_list;
+        sh.free_list = ofptr;
+        pthread_mutex_unlock(&sh.mtx);
+}
+
+bool OpenFileTable::MarkDeleted(int idx)
+{
+        Shard &sh = ShardFor(idx);
+        pthread_mutex_lock(&sh.mtx);
+        OpenedFile **pe = Find(sh, idx);
+        OpenedFile *ofptr = *pe;
+        if (ofptr) {
+                ofptr->defer_delete = true;
+                *pe = ofptr->hash_next;
+                ofptr->hash_next = 0;
+                sh.used--;
+        }
+        pthread_mutex_unlock(&sh.mtx);
+        return ofptr != 0;
+}
+
+void OpenFileTable::WriteBack()
+{
+        for (int i = 0; i < shards_amount; i++) {
+                Shard &sh = shards[i];
+                pthread_mutex_lock(&sh.mtx);
+                for (size_t j = 0; j < sh.table_size; j++) {
+                        OpenedFile *tmp;
+                        for (tmp = sh.table[j]; tmp; tmp = tmp->hash_next) {
+                                pthread_mutex_lock(&tmp->mtx);
+                                im.WriteInode(&tmp->in, tmp->inode_idx);
+                                pthread_mutex_unlock(&tmp->mtx);
+                        }
+                }
+                pthread_mutex_unlock(&sh.mtx);
+        }
+}
+
+OpenedFile **OpenFileTable::Find(Shard &sh, int idx)
+{
+        OpenedFile **pe = &sh.table[(idx / shards_amount) &
+                                    (sh.table_size - 1)];
+        while (*pe && (*pe)->inode_idx != idx)
+                pe = &(*pe)->hash_next;
+        return pe;
+}
+
+void OpenFileTable::Grow(Shard &sh)
+{
+        size_t new_size = sh.table_size * 2;
+        OpenedFile **table = new OpenedFile*[new_size];
+        memset(table, 0, new_size * sizeof(OpenedFile*));
+        for (size_t j = 0; j < sh.table_size; j++) {
+                while (sh.table[j]) {
+                        OpenedFile *tmp = sh.table[j];
+                        sh.table[j] = tmp->hash_next;
+                        OpenedFile **head = &table[(tmp->inode_idx /
+                                                    shards_amount) &
+                                                   (new_size - 1)];
+                        tmp->hash_next = *head;
+                        *head = tmp;
+                }
+        }
+        delete[] sh.table;
+        sh.table = table;
+        sh.table_size = new_size;
+}
@@ -0,0 +1,53 @@
+#ifndef OPENFILETABLE_HPP_SENTRY
+#define OPENFILETABLE_HPP_SENTRY
+
+#include <cstddef>
+#include <pthread.h>
+#include "inodemanager.hpp"
+
+struct OpenedFile {
+        int inode_idx;
+        int opened;
+        bool perm_read;
+        bool perm_write;
+        bool defer_delete;
+        struct Inode in;
+        pthread_mutex_t mtx;
+        OpenedFile *hash_next;
+};
+
+/* Files currently open, hashed by inode number into independently locked
+ * shards.  A file removed while open leaves the table at once, so a reused
+ * inode number never finds it, and lives on until its last Release().
+ * Released entries are kept on per-shard free lists for reuse. */
+class OpenFileTable {
+        static const int shards_amount = 16;
+        static const size_t initial_table_size = 64;
+        struct Shard {
+                pthread_mutex_t mtx;
+                OpenedFile **table;
+                size_t table_size;
+                size_t used;
+                OpenedFile *free_list;
+        };
+        Shard shards[shards_amount];
+        InodeManager &im;
+public:
+        OpenFileTable(InodeManager &imgr);
+        ~OpenFileTable();
+        OpenedFile *Open(int idx, bool want_read, bool want_write);
+        bool Release(OpenedFile *ofptr);
+        void Recycle(OpenedFile *ofptr);
+        bool MarkDeleted(int idx);
+        void WriteBack();
+private:
+        Shard &ShardFor(int idx) {
+                return shards[(unsigned)idx % shards_amount];
+        }
+        static OpenedFile **Find(Shard &sh, int idx);
+        static void Grow(Shard &sh);
+        OpenFileTable(const OpenFileTable&);
+        void operator=(const OpenFileTable&);
+};
+
+#endif /* OPENFILETABLE_HPP_SENTRY */
@@ -0,0 +1,107 @@
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "superblock.hpp"
+
+Geometry Superblock::Default()
+{
+        Geometry geometry;
+        geometry.block_size = 4096;
+        geometry.storage_amount = 4;
+        geometry.storage_size = 16384;
+        geometry.max_file_amount = 1000000;
+        geometry.stripe_blocks = 0;
+        return geometry;
+}
+
+/* Blocks are whole pages, so the cache can drop them one by one, and at
+ * most 64 KB, so extent and directory block counters fit 16 bits.  Each
+ * storage takes whole words of the free block bitmap. */
+bool Superblock::Valid(const Geometry &geometry)
+{
+        uint32_t bs = geometry.block_size;
+        if (bs < min_block_size || bs > max_block_size || (bs & (bs - 1))) {
+                fprintf(stderr, "Bad block size %u\n", bs);
+                return false;
+        }
+        if (geometry.storage_amount == 0 ||
+            geometry.storage_amount > max_storage_amount) {
+                fprintf(stderr, "Bad storage amount %u\n",
+                        geometry.storage_amount);
+                return false;
+        }
+        if (geometry.storage_size == 0 || geometry.storage_size % 64 ||
+            geometry.storage_size > max_storage_size) {
+                fprintf(stderr, "Bad storage size %u\n",
+                        geometry.storage_size);
+                return false;
+        }
+        if (geometry.max_file_amount < 2 ||
+            geometry.max_file_amount > max_files) {
+                fprintf(stderr, "Bad file amount %u\n",
+                        geometry.max_file_amount);
+                return false;
+        }
+        if (geometry.stripe_blocks > geometry.storage_size) {
+                fprintf(stderr, "Bad stripe size %u\n",
+                        geometry.stripe_blocks);
+                return false;
+        }
+        return true;
+}
+
+bool Superblock::Write(int dir_fd, const Geometry &geometry)
+{
+        int fd = openat(dir_fd, "superblock.new",
+                        O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                perror("Superblock::Write(): open");
+                return false;
+        }
+        Layout sb;
+        sb.magic = magic;
+        sb.version = version;
+        sb.geometry = geometry;
+        ssize_t res = write(fd, &sb, sizeof(sb));
+        if (res != (ssize_t)sizeof(sb) || fsync(fd) == -1) {
+                perror("Superblock::Write(): write");
+                close(fd);
+                return false;
+        }
+        close(fd);
+        if (renameat(dir_fd, "superblock.new", dir_fd, "superblock") == -1) {
+                perror("Superblock::Write(): rename");
+                return false;
+        }
+        return true;
+}
+
+bool Superblock::Read(int dir_fd, Geometry &geometry)
+{
+        int fd = openat(dir_fd, "superblock", O_RDONLY);
+        if (fd == -1 && errno == ENOENT) {
+                geometry = Default();
+                return true;
+        }
+        if (fd == -1) {
+                perror("Superblock::Read(): open");
+                return false;
+        }
+        Layout sb;
+        ssize_t res = read(fd, &sb, sizeof(sb));
+        close(fd);
+        if (res < v1_size || sb.magic != magic) {
+                fputs("Superblock::Read(): not a superblock\n", stderr);
+                return false;
+        }
+        if (sb.version == 1 && res == v1_size) {
+                sb.geometry.stripe_blocks = 0;
+        } else if (sb.version != version || res != (ssize_t)sizeof(sb)) {
+                fprintf(stderr, "Superblock::Read(): unknown version %u\n",
+                        sb.version);
+                return false;
+        }
+        geometry = sb.geometry;
+        return Valid(geometry);
+}
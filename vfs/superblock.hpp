@@ -0,0 +1,43 @@
+#ifndef SUPERBLOCK_HPP_SENTRY
+#define SUPERBLOCK_HPP_SENTRY
+
+#include <stdint.h>
+
+/* Layout parameters of a file system, chosen when it is made.  With
+ * stripe_blocks set, files grow in units of that many blocks placed on
+ * the storages in turn, so large transfers can use them all at once. */
+struct Geometry {
+        uint32_t block_size;
+        uint32_t storage_amount;
+        uint32_t storage_size;
+        uint32_t max_file_amount;
+        uint32_t stripe_blocks;
+};
+
+/* The superblock file keeps the geometry of the file system, so every
+ * manager is set up from it at boot.  Images made before it existed have
+ * no superblock and get the default geometry they were made with.  The
+ * file is replaced as a whole, so a crash leaves the old or the new one. */
+class Superblock {
+        static const uint32_t magic = 0x42534656;
+        static const uint32_t version = 2;
+        /* version 1 had no stripe_blocks */
+        static const int v1_size = 24;
+        struct Layout {
+                uint32_t magic;
+                uint32_t version;
+                Geometry geometry;
+        };
+public:
+        static const uint32_t min_block_size = 4096;
+        static const uint32_t max_block_size = 65536;
+        static const uint32_t max_storage_amount = 64;
+        static const uint32_t max_storage_size = 1 << 24;
+        static const uint32_t max_files = 1 << 28;
+        static Geometry Default();
+        static bool Valid(const Geometry &geometry);
+        static bool Write(int dir_fd, const Geometry &geometry);
+        static bool Read(int dir_fd, Geometry &geometry);
+};
+
+#endif /* SUPERBLOCK_HPP_SENTRY */